@@ -0,0 +1,111 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "../tests/reader.h"
+
+using namespace secd;
+
+namespace {
+
+    struct Result {
+        double seconds;
+        size_t instructions;
+        size_t functions;
+    };
+
+    /** Runs all forms of the program with a fresh interpreter, the output of the program is discarded.
+     */
+    Result run(std::string const & source, bool inlining, bool optimizer, size_t profile) {
+        std::stringstream output;
+        std::streambuf * console = std::cout.rdbuf(output.rdbuf());
+        Interpreter interpreter;
+        if (! inlining)
+            interpreter.compiler().optimizer().setInlineThreshold(0);
+        interpreter.compiler().optimizer().setEnabled(optimizer);
+        Reader reader(source);
+        auto start = std::chrono::steady_clock::now();
+        while (! reader.eof()) {
+            Value x = reader.read();
+            try {
+                interpreter.run(interpreter.compile(x));
+            } catch (std::exception const & e) {
+                std::cerr << "ERROR: " << e.what() << std::endl;
+            } catch (char const * e) {
+                std::cerr << "ERROR: " << e << std::endl;
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout.rdbuf(console);
+        if (profile > 0)
+            interpreter.profile().print(std::cout, profile);
+        return Result{seconds, interpreter.instructions(), interpreter.jit().functions()};
+    }
+
+} // anonymous namespace
+
+/** Runs the benchmark programs and reports their best time, the instructions executed and the work of the GC.
+
+    Usage: secd-bench [--runs n] [--no-inline] [--no-optimizer] [--profile n] program...
+
+    Each program runs the given number of times, each time with a fresh interpreter, and the fastest run is reported. The GC figures are averaged over the runs, except for the longest pause and the resident size, which are those of the whole process so far. With --profile, the given number of the most frequent opcode pairs and triples of the last run are printed, which requires the library compiled with SECD_PROFILE_OPCODES, such as secd-profile is.
+
+    The JIT threshold and the GC are configured by the SECD_JIT_THRESHOLD and SECD_GC_* environment variables.
+ */
+int main(int argc, char * argv[]) {
+    size_t runs = 1;
+    size_t profile = 0;
+    bool inlining = true;
+    bool optimizer = true;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; ++arg) {
+        if (strcmp(argv[arg], "--runs") == 0 && arg + 1 < argc) {
+            runs = std::max(1, atoi(argv[++arg]));
+        } else if (strcmp(argv[arg], "--profile") == 0 && arg + 1 < argc) {
+            profile = std::max(1, atoi(argv[++arg]));
+        } else if (strcmp(argv[arg], "--no-inline") == 0) {
+            inlining = false;
+        } else if (strcmp(argv[arg], "--no-optimizer") == 0) {
+            optimizer = false;
+        } else {
+            std::cerr << "Unknown option " << argv[arg] << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (arg == argc) {
+        std::cerr << "Usage: " << argv[0] << " [--runs n] [--no-inline] [--no-optimizer] [--profile n] program..." << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << std::fixed;
+    for (; arg < argc; ++arg) {
+        std::ifstream program(argv[arg]);
+        if (! program.good()) {
+            std::cerr << "Unable to open " << argv[arg] << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::stringstream source;
+        source << program.rdbuf();
+        std::cout << argv[arg] << std::endl;
+        GC::Stats before = GC::Statistics();
+        Result best{0, 0, 0};
+        for (size_t i = 0; i < runs; ++i) {
+            Result r = run(source.str(), inlining, optimizer, i + 1 == runs ? profile : 0);
+            if (i == 0 || r.seconds < best.seconds)
+                best = r;
+        }
+        GC::Stats after = GC::Statistics();
+        std::cout << "    " << std::setprecision(3) << best.seconds << " s, "
+            << std::setprecision(1) << best.instructions / 1e6 << " M instructions, "
+            << best.instructions / best.seconds / 1e6 << " M/s, "
+            << best.functions << " functions compiled" << std::endl;
+        std::cout << "    " << (after.allocations - before.allocations) / runs << " cells allocated, "
+            << (after.minorCycles - before.minorCycles) / runs << " minor and "
+            << (after.cycles - before.cycles) / runs << " full GCs per run, max pause "
+            << std::setprecision(2) << std::max(after.maxMinorPauseNs, after.maxMajorPauseNs) / 1e6 << " ms, "
+            << std::setprecision(1) << after.residentBytes / 1048576.0 << " MiB resident" << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "secd/data_types.h"
+#include "secd/gc.h"
+#include "secd/value.h"
+
+using namespace secd;
+
+namespace {
+
+    double milliseconds(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    /** Sums the integers of the list of lists, which touches every live cell once in the order of the list.
+     */
+    int64_t traverse(ValueRef list) {
+        int64_t result = 0;
+        for (; list.isCons(); list = list.cdr())
+            for (ValueRef inner = list.car(); inner.isCons(); inner = inner.cdr())
+                result += inner.car().valueInt();
+        return result;
+    }
+
+    /** Times a full collection of the heap under the given policy and the traversal of the live list right after it, the best of the given number of runs is reported.
+     */
+    void collect(std::string const & name, GC::HeapPolicy const & policy, Value const & live, size_t runs) {
+        GC::Configure(policy);
+        double gc = 0;
+        double traversal = 0;
+        for (size_t i = 0; i < runs; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            GC::Run();
+            double ms = milliseconds(start);
+            if (i == 0 || ms < gc)
+                gc = ms;
+            start = std::chrono::steady_clock::now();
+            volatile int64_t sum = traverse(live);
+            (void)sum;
+            ms = milliseconds(start);
+            if (i == 0 || ms < traversal)
+                traversal = ms;
+        }
+        std::cout << "    " << std::left << std::setw(24) << name << std::right << std::setw(10) << gc << " ms, traversal" << std::setw(10) << traversal << " ms" << std::endl;
+    }
+
+} // anonymous namespace
+
+/** Measures the full collections of a large live heap, in the mark-sweep mode with increasing numbers of marking threads and in the copying mode, and the traversal of the live data after each of them.
+
+    Usage: secd-gc-bench [cells] [runs] [threads]
+
+    The marking threads double from 1 up to the given number, which defaults to the number of hardware threads, but at least 8.
+
+    The heap holds the given number of live cells (4M by default) as a list of short lists, so that there are both long spines to mark and many small lists to spread over the threads. The short lists are picked at random from twice as many, so that after the rest becomes garbage the live ones are scattered over the heap as a free list would scatter them after a few collections. The mark-sweep collections leave them in place, while the copying one, which runs last, moves them next to their spine. Other settings of the heap are read from the SECD_GC_* environment variables.
+ */
+int main(int argc, char * argv[]) {
+    size_t cells = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 4 * 1024 * 1024;
+    size_t runs = argc > 2 ? std::max(1ul, std::strtoul(argv[2], nullptr, 10)) : 3;
+    size_t maxThreads = argc > 3 ? std::max(1ul, std::strtoul(argv[3], nullptr, 10)) : std::max(8u, std::thread::hardware_concurrency());
+    GC::HeapPolicy policy = GC::HeapPolicy::FromEnvironment();
+    policy.initialHeapSize = std::max(policy.initialHeapSize, cells * 3);
+    GC::Configure(policy);
+    // each element of the list takes 4 cells, the cons of the spine and the three conses of the inner list, whose integers are immediate
+    size_t elements = cells / 4;
+    Value live;
+    {
+        ValueStack pool;
+        for (size_t i = 0; i < 2 * elements; ++i) {
+            Value inner = Nil;
+            for (int j = 0; j < 3; ++j)
+                inner = Value::Cons(Value::Integer(j), inner);
+            pool.push(inner);
+        }
+        std::vector<size_t> order(pool.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+        std::shuffle(order.begin(), order.end(), std::mt19937(42));
+        for (size_t i = 0; i < elements; ++i)
+            live = Value::Cons(pool[order[i]], live);
+    }
+    std::cout << "full collection of " << elements * 4 << " live cells" << std::endl << std::fixed << std::setprecision(2);
+    for (size_t threads = 1; ; threads = std::min(threads * 2, maxThreads)) {
+        policy.mode = GC::Mode::MarkSweep;
+        policy.markThreads = threads;
+        collect("mark-sweep, " + std::to_string(threads) + (threads == 1 ? " thread" : " threads"), policy, live, runs);
+        if (threads == maxThreads)
+            break;
+    }
+    policy.mode = GC::Mode::Copying;
+    policy.markThreads = 1;
+    collect("copying", policy, live, runs);
+    return EXIT_SUCCESS;
+}
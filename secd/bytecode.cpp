@@ -0,0 +1,276 @@
+#include "bytecode.h"
+#include "secd.h"
+
+namespace secd {
+
+    size_t Bytecode::lower(Value const & code) {
+        size_t entry = code_.size();
+        Functions functions;
+        if (lowerBlock(code, functions) != SIZE_MAX)
+            throw std::runtime_error("JOIN outside of conditional");
+        emit(Instruction::STOP);
+        // lowering a function body may add further functions
+        for (size_t i = 0; i < functions.size(); ++i) {
+            code_[functions[i].first] = static_cast<uint32_t>(code_.size());
+            Value body = functions[i].second;
+            if (lowerBlock(body, functions) != SIZE_MAX)
+                throw std::runtime_error("JOIN outside of conditional");
+        }
+        return entry;
+    }
+
+    size_t Bytecode::OperandCount(uint32_t opcode) {
+        switch (opcode) {
+        case Instruction::LD:
+        case Instruction::LDC_LD0_ADD:
+        case Instruction::LDC_LD0_SUB:
+        case Instruction::LDC_LD0_LT:
+        case Instruction::LDC_LD0_GT:
+        case Instruction::LDC_LD0_EQ:
+        case Instruction::LD0_LD0_ADD:
+        case Instruction::LDG_APN:
+        case Instruction::LDG_TAPN:
+        case Instruction::LDF:
+            return 2;
+        case Instruction::LDC_LD0_BLT:
+        case Instruction::LDC_LD0_BGT:
+        case Instruction::LDC_LD0_BEQ:
+        case Instruction::LDB:
+            return 3;
+        case Instruction::LD0:
+        case Instruction::LD1:
+        case Instruction::LDG:
+        case Instruction::LDE:
+        case Instruction::DEFUN:
+        case Instruction::APN:
+        case Instruction::TAPN:
+        case Instruction::RAPN:
+        case Instruction::TRAPN:
+        case Instruction::LDC:
+        case Instruction::SEL:
+        case Instruction::BLT:
+        case Instruction::BGT:
+        case Instruction::BEQ:
+        case Instruction::BNIL:
+        case Instruction::JOIN:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    size_t Bytecode::lowerBlock(Value const & code, Functions & functions) {
+        // the block is copied to a vector so that the peephole pass can look ahead
+        std::vector<Value> c;
+        for (ValueRef x = code; x.isCons(); x = x.cdr())
+            c.push_back(x.car());
+        size_t i = 0;
+        while (i < c.size()) {
+            size_t fused = fuse(c, i, functions);
+            if (fused != 0) {
+                i += fused;
+                continue;
+            }
+            int64_t opcode = c[i++].valueInt();
+            switch (opcode) {
+            case Instruction::LDC:
+                emit(Instruction::LDC);
+                emitConstant(c[i++]);
+                break;
+            case Instruction::APN:
+            case Instruction::TAPN:
+            case Instruction::RAPN:
+            case Instruction::TRAPN:
+            case Instruction::LDG:
+            case Instruction::LDE:
+            case Instruction::DEFUN:
+                emit(static_cast<uint32_t>(opcode));
+                emitOperand(c[i++].valueInt());
+                break;
+            case Instruction::LD: {
+                int64_t address = c[i++].valueInt();
+                int64_t depth = Instruction::AddressDepth(address);
+                if (depth == 0) {
+                    emit(Instruction::LD0);
+                } else if (depth == 1) {
+                    emit(Instruction::LD1);
+                } else {
+                    emit(Instruction::LD);
+                    emitOperand(depth);
+                }
+                emitOperand(Instruction::AddressOffset(address));
+                break;
+            }
+            case Instruction::LDB: {
+                int64_t address = c[i++].valueInt();
+                emit(Instruction::LDB);
+                emitOperand(Instruction::AddressDepth(address));
+                emitOperand(Instruction::AddressOffset(address));
+                emitOperand(c[i++].valueInt());
+                break;
+            }
+            case Instruction::SEL:
+            case Instruction::BLT:
+            case Instruction::BGT:
+            case Instruction::BEQ:
+            case Instruction::BNIL: {
+                size_t sel = code_.size();
+                emit(static_cast<uint32_t>(opcode));
+                emit(0);
+                lowerBranches(sel, sel + 1, c[i], c[i + 1], functions);
+                i += 2;
+                break;
+            }
+            case Instruction::JOIN: {
+                if (i != c.size())
+                    throw std::runtime_error("JOIN must be the last instruction of a conditional branch");
+                size_t result = code_.size();
+                emit(Instruction::JOIN);
+                emit(0);
+                return result;
+            }
+            case Instruction::LDF:
+                emit(Instruction::LDF);
+                emitOperand(c[i++].valueInt());
+                functions.push_back(std::make_pair(code_.size(), c[i++]));
+                emit(0);
+                break;
+            case Instruction::NIL:
+            case Instruction::AP:
+            case Instruction::RTN:
+            case Instruction::DUM:
+            case Instruction::TAP:
+            case Instruction::POP:
+            case Instruction::CONS:
+            case Instruction::CAR:
+            case Instruction::CDR:
+            case Instruction::CONSP:
+            case Instruction::ADD:
+            case Instruction::SUB:
+            case Instruction::MUL:
+            case Instruction::DIV:
+            case Instruction::EQ:
+            case Instruction::LT:
+            case Instruction::GT:
+            case Instruction::PRINT:
+            case Instruction::READ:
+                emit(static_cast<uint32_t>(opcode));
+                break;
+            default:
+                throw std::runtime_error(STR("Undefined opcode " << opcode));
+            }
+        }
+        return SIZE_MAX;
+    }
+
+    void Bytecode::lowerBranches(size_t instruction, size_t operand, Value const & trueCase, Value const & falseCase, Functions & functions) {
+        size_t trueJoin = lowerBlock(trueCase, functions);
+        code_[operand] = static_cast<uint32_t>(code_.size() - instruction);
+        size_t falseJoin = lowerBlock(falseCase, functions);
+        if (trueJoin == SIZE_MAX || falseJoin == SIZE_MAX)
+            throw std::runtime_error("Conditional branch must end with JOIN");
+        code_[trueJoin + 1] = static_cast<uint32_t>(code_.size() - trueJoin);
+        code_[falseJoin + 1] = static_cast<uint32_t>(code_.size() - falseJoin);
+    }
+
+    size_t Bytecode::fuse(std::vector<Value> const & c, size_t i, Functions & functions) {
+        // operands are never looked at as opcodes as all instructions matched have a single operand in the compiled code, the branches have two
+        auto opcode = [& c](size_t i) {
+            return i < c.size() ? c[i].valueInt() : -1;
+        };
+        auto local = [& c, & opcode](size_t i) {
+            return opcode(i) == Instruction::LD && Instruction::AddressDepth(c[i + 1].valueInt()) == 0;
+        };
+        auto offset = [& c](size_t i) {
+            return Instruction::AddressOffset(c[i + 1].valueInt());
+        };
+        // binary operator of local variable and constant
+        if (opcode(i) == Instruction::LDC && local(i + 2)) {
+            uint32_t fused = 0;
+            bool branch = false;
+            switch (opcode(i + 4)) {
+            case Instruction::ADD:
+                fused = Instruction::LDC_LD0_ADD;
+                break;
+            case Instruction::SUB:
+                fused = Instruction::LDC_LD0_SUB;
+                break;
+            case Instruction::LT:
+                fused = Instruction::LDC_LD0_LT;
+                break;
+            case Instruction::GT:
+                fused = Instruction::LDC_LD0_GT;
+                break;
+            case Instruction::EQ:
+                fused = Instruction::LDC_LD0_EQ;
+                break;
+            case Instruction::BLT:
+                fused = Instruction::LDC_LD0_BLT;
+                branch = true;
+                break;
+            case Instruction::BGT:
+                fused = Instruction::LDC_LD0_BGT;
+                branch = true;
+                break;
+            case Instruction::BEQ:
+                fused = Instruction::LDC_LD0_BEQ;
+                branch = true;
+                break;
+            default:
+                break;
+            }
+            if (fused != 0) {
+                size_t instruction = code_.size();
+                emit(fused);
+                emitConstant(c[i + 1]);
+                emitOperand(offset(i + 2));
+                if (! branch)
+                    return 5;
+                emit(0);
+                lowerBranches(instruction, instruction + 3, c[i + 5], c[i + 6], functions);
+                return 7;
+            }
+        }
+        // sum of two local variables
+        if (local(i) && local(i + 2) && opcode(i + 4) == Instruction::ADD) {
+            emit(Instruction::LD0_LD0_ADD);
+            emitOperand(offset(i));
+            emitOperand(offset(i + 2));
+            return 5;
+        }
+        // call of a global function
+        if (opcode(i) == Instruction::LDG && (opcode(i + 2) == Instruction::APN || opcode(i + 2) == Instruction::TAPN)) {
+            emit(opcode(i + 2) == Instruction::APN ? Instruction::LDG_APN : Instruction::LDG_TAPN);
+            emitOperand(c[i + 1].valueInt());
+            emitOperand(c[i + 3].valueInt());
+            return 4;
+        }
+        return 0;
+    }
+
+    void Bytecode::emitConstant(Value const & value) {
+        size_t index = constants_.size();
+        if (value.isInteger()) {
+            auto i = integers_.insert(std::make_pair(value.valueInt(), index));
+            if (! i.second) {
+                emitOperand(i.first->second);
+                return;
+            }
+        } else if (value.isSymbol()) {
+            auto i = symbols_.insert(std::make_pair(value.name(), index));
+            if (! i.second) {
+                emitOperand(i.first->second);
+                return;
+            }
+        }
+        emitOperand(index);
+        constants_.push(value);
+    }
+
+    void Bytecode::emitOperand(int64_t value) {
+        if (value < 0 || value > UINT32_MAX)
+            throw std::runtime_error(STR("Operand " << value << " does not fit in the bytecode"));
+        emit(static_cast<uint32_t>(value));
+    }
+
+} // namespace secd
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "value.h"
+#include "data_types.h"
+
+namespace secd {
+
+    /** Flat contiguous form of the compiled code.
+
+        The cons list code produced by the Compiler is lowered into a single stream of 32bit words so that fetching an instruction is an array access instead of a pointer chase and the code takes no space in the GC heap. Each instruction is its opcode followed by its operands:
+
+        LDC index - index of the value in the constant pool, in which each integer and symbol is only once
+        LD depth offset - location of the variable in the environment
+        LD0 offset, LD1 offset - variable in the current or the parent frame
+        LDG offset - global variable
+        LDE depth - frame at the given depth of the environment
+        LDB depth offset slot - slot of the frame which is the variable at the given location
+        APN count, TAPN count, RAPN count, TRAPN count - number of arguments on the stack
+
+        Frequent instruction sequences of the compiled code are fused into superinstructions by a peephole pass:
+
+        LDC_LD0_ADD, LDC_LD0_SUB, LDC_LD0_LT, LDC_LD0_GT, LDC_LD0_EQ index offset - LDC index LD0 offset followed by the operator
+        LD0_LD0_ADD offset offset - LD0 offset LD0 offset ADD
+        LDG_APN offset count, LDG_TAPN offset count - LDG offset followed by APN count or TAPN count
+        LDC_LD0_BLT, LDC_LD0_BGT, LDC_LD0_BEQ index offset else - LDC index LD0 offset followed by the branch
+
+        Instructions are only fused within a single block so that no jump can target the middle of a superinstruction.
+
+        The interpreter quickens ADD, SUB, LT, GT, EQ, CAR and CDR in place to ADD_II, SUB_II, LT_II, GT_II, EQ_II, EQ_SYM, CAR_C and CDR_C, which have no operands either.
+        SEL else - the true branch follows, else is the offset of the false branch relative to the SEL instruction
+        BLT else, BGT else, BEQ else, BNIL else - branch as SEL on the comparison of the values on the stack, or on the value being nil
+        JOIN next - offset of the instruction following the whole conditional relative to the JOIN instruction, i.e. no dump is used
+        LDF count entry - number of the captured variables on the stack and the absolute offset of the function body
+
+        The function bodies follow the code they are defined in and each lowered program ends with STOP. The stream is append-only so that the offsets of the code already lowered stay valid when more code is added.
+     */
+    class Bytecode {
+    public:
+
+        /** Lowers the given compiled code, appends it to the stream and returns the offset of its first instruction.
+         */
+        size_t lower(Value const & code);
+
+        /** Returns the number of operand words following the given opcode.
+         */
+        static size_t OperandCount(uint32_t opcode);
+
+        size_t size() const {
+            return code_.size();
+        }
+
+        uint32_t const * code() const {
+            return code_.data();
+        }
+
+        uint32_t operator [] (size_t offset) const {
+            assert(offset < code_.size() && "Offset out of bounds");
+            return code_[offset];
+        }
+
+        /** Replaces the opcode at the given offset by one with the same operands, used by the interpreter to quicken the instructions while running.
+
+            The stream is not reallocated, so the pointer to the code stays valid.
+         */
+        void rewrite(size_t offset, uint32_t opcode) {
+            assert(offset < code_.size() && OperandCount(opcode) == OperandCount(code_[offset]) && "Rewritten instruction must have the same operands");
+            code_[offset] = opcode;
+        }
+
+        size_t numConstants() const {
+            return constants_.size();
+        }
+
+        /** Returns the constant with the given index, which is only valid until the next allocation.
+         */
+        ValueRef constant(size_t index) const {
+            return constants_[index];
+        }
+
+    private:
+        friend class Jit;
+
+        /** Function bodies yet to be lowered with the offset of the operand of their LDF instruction.
+         */
+        using Functions = std::vector<std::pair<size_t, Value>>;
+
+        /** Lowers single block of code. If the block ends with JOIN, returns the offset of the JOIN instruction so that its target can be patched, otherwise returns SIZE_MAX.
+         */
+        size_t lowerBlock(Value const & code, Functions & functions);
+
+        /** Emits a superinstruction if one matches the compiled code at the given position of the block and returns the number of elements of the compiled code it replaces, returns 0 if none matches.
+         */
+        size_t fuse(std::vector<Value> const & c, size_t i, Functions & functions);
+
+        /** Lowers the branches of a conditional instruction and patches the offset of its false branch, which is relative to the instruction.
+         */
+        void lowerBranches(size_t instruction, size_t operand, Value const & trueCase, Value const & falseCase, Functions & functions);
+
+        /** Adds the value to the constant pool, unless it is an integer or a symbol that is there already, and emits its index.
+         */
+        void emitConstant(Value const & value);
+
+        void emit(uint32_t word) {
+            code_.push_back(word);
+        }
+
+        /** Emits operand which must fit in the 32bit word.
+         */
+        void emitOperand(int64_t value);
+
+        std::vector<uint32_t> code_;
+
+        /** Values loaded by LDC. The pool is a single root range, so that the constants do not add to the roots of the GC one by one.
+         */
+        ValueStack constants_;
+
+        /** Indices of the integer and symbol constants in the pool. Integers and symbols are equal if their values and names are, so each one only needs to be in the pool once. Other constants, i.e. quoted lists, are distinct objects even if they look the same.
+         */
+        std::unordered_map<int64_t, size_t> integers_;
+        std::unordered_map<std::string, size_t> symbols_;
+
+    }; // secd::Bytecode
+
+} // namespace secd
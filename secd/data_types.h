@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdlib>
+#include <new>
 #include <ostream>
 
 #include "value.h"
@@ -31,7 +33,7 @@ namespace secd {
 
         Value pop() {
             Value result = v_.car();
-            v_ = v_.cdr();
+            v_ = v_.ref().cdr();
             return result;
         }
 
@@ -52,6 +54,107 @@ namespace secd {
 
     }; // tlisp::Stack
 
+    /** Stack of values backed by a contiguous array.
+
+        Unlike Stack, pushing and popping does not allocate any cells. The whole stack is registered with the GC as a single root range, so the values stored in it are not rooted individually.
+     */
+    class ValueStack {
+    public:
+        ValueStack():
+            begin_(nullptr),
+            top_(nullptr),
+            end_(nullptr),
+            range_(begin_, top_) {
+            GC::AddRootRange(range_);
+        }
+
+        ValueStack(ValueStack const &) = delete;
+
+        ValueStack & operator = (ValueStack const &) = delete;
+
+        ~ValueStack() {
+            GC::RemoveRootRange(range_);
+            free(begin_);
+        }
+
+        bool empty() const {
+            return top_ == begin_;
+        }
+
+        size_t size() const {
+            return top_ - begin_;
+        }
+
+        void push(ValueRef value) {
+            if (top_ == end_)
+                grow();
+            *top_++ = value.data_;
+        }
+
+        Value pop() {
+            assert(! empty() && "Popping from empty stack");
+            return Value(ValueRef(*--top_));
+        }
+
+        /** Returns the top of the stack, which is only valid until the next allocation.
+         */
+        ValueRef top() const {
+            assert(! empty() && "Empty stack has no top");
+            return ValueRef(top_[-1]);
+        }
+
+        /** Replaces the top of the stack.
+         */
+        void setTop(ValueRef value) {
+            assert(! empty() && "Empty stack has no top");
+            top_[-1] = value.data_;
+        }
+
+        /** Returns the value at the given height, which is only valid until the next allocation.
+         */
+        ValueRef operator [] (size_t index) const {
+            assert(index < size() && "Index out of bounds");
+            return ValueRef(begin_[index]);
+        }
+
+        /** Discards the values above the given height.
+         */
+        void truncate(size_t height) {
+            assert(height <= size() && "Cannot truncate above the top");
+            top_ = begin_ + height;
+        }
+
+        void clear() {
+            top_ = begin_;
+        }
+
+        /** Makes sure the given number of values can be pushed without growing the stack.
+         */
+        void reserve(size_t values) {
+            while (static_cast<size_t>(end_ - top_) < values)
+                grow();
+        }
+
+    private:
+        friend class Jit;
+
+        void grow() {
+            size_t size = top_ - begin_;
+            size_t capacity = end_ == begin_ ? 1024 : (end_ - begin_) * 2;
+            GC::Cell ** x = static_cast<GC::Cell **>(realloc(begin_, sizeof(GC::Cell *) * capacity));
+            if (x == nullptr)
+                throw std::bad_alloc();
+            begin_ = x;
+            top_ = x + size;
+            end_ = x + capacity;
+        }
+
+        GC::Cell ** begin_;
+        GC::Cell ** top_;
+        GC::Cell ** end_;
+        GC::RootRange range_;
+    }; // secd::ValueStack
+
     /** Wrapper around the cons cells that makes using the tinyLISP lists from C++ easier.
 
      */
@@ -1,106 +1,1041 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
 #include <vector>
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fstream>
+#endif
+
 #include "gc.h"
 #include "common/colors.h"
 
 namespace secd {
 
     size_t GC::allocations_ = 0;
+
+    size_t GC::minorAllocations_ = 0;
+
+    size_t GC::majorAllocations_ = 0;
+
+    size_t GC::recovered_ = 0;
+
+    size_t GC::cycles_ = 0;
+
+    size_t GC::minorCycles_ = 0;
+
+    size_t GC::promoted_ = 0;
+
+    uint64_t GC::minorTimeNs_ = 0;
+
+    uint64_t GC::majorTimeNs_ = 0;
+
+    uint64_t GC::maxMinorPauseNs_ = 0;
+
+    uint64_t GC::maxMajorPauseNs_ = 0;
+
+    uint64_t GC::sweepTimeNs_ = 0;
+
+    uint64_t GC::maxSweepNs_ = 0;
+
+    uint64_t GC::pauses_[GC::PauseHistory];
+
+    size_t GC::numPauses_ = 0;
+
+    size_t GC::minorHistogram_[GC::HistogramBuckets];
+
+    size_t GC::majorHistogram_[GC::HistogramBuckets];
+
+    std::vector<std::pair<size_t, GC::Listener>> GC::listeners_;
+
+    size_t GC::nextListenerId_ = 0;
+
+    size_t GC::bankBytes_ = 0;
+
+    size_t GC::bankCells_ = 0;
+
+    size_t GC::bitmapWords_ = 0;
+
+    GC::Bank * GC::allocBank_ = nullptr;
+
+    size_t GC::allocWord_ = 0;
+
+    uint64_t GC::freeBits_ = 0;
+
+    std::vector<GC::Bank *> GC::toSpace_;
+
+    GC::Cell * GC::copyTop_ = nullptr;
+
+    GC::Cell * GC::copyEnd_ = nullptr;
+
+    size_t GC::freeCells_ = 0;
+
+    GC::Cell * GC::nursery_ = nullptr;
+
+    GC::Cell * GC::nurseryTop_ = nullptr;
+
+    GC::Cell * GC::nurseryEnd_ = nullptr;
+
+    size_t GC::nurserySize_ = GC::DefaultNurserySize;
+
+    uint64_t * GC::nurseryForwarded_ = nullptr;
+
+    uintptr_t * GC::region_ = nullptr;
+
+    uintptr_t * GC::regionTop_ = nullptr;
+
+    uintptr_t * GC::regionEnd_ = nullptr;
+
+    size_t GC::regionFrames_ = 0;
+
+    std::vector<GC::Cell *> GC::remembered_;
+
+    std::vector<GC::Cell *> GC::promotedQueue_;
+
+    std::vector<GC::Cell *> GC::youngFrames_;
+
+    std::vector<GC::Cell *> GC::frames_;
     
     size_t GC::numBanks_ = 0;
+
+    size_t GC::releasedBanks_ = 0;
+
+    size_t GC::surplusCycles_ = 0;
+
+    std::vector<void *> GC::freeBlocks_;
+
+
+    size_t GC::heapSize_ = 0;
+
+    GC::HeapPolicy GC::policy_;
+
+    bool GC::initialized_ = false;
+
+    uint64_t GC::lastGcTimeNs_ = 0;
+
+    uint64_t GC::lastMajorEndNs_ = 0;
     
     size_t GC::liveObjects_ = 0;
 
     GC::Bank * GC::bank_ = nullptr;
 
-    GC::Cell * GC::freeList_ = nullptr;
+    GC::Cell *** GC::roots_ = nullptr;
+
+    size_t GC::numRoots_ = 0;
 
-    std::unordered_set<GC::Cell **> GC::roots_;
+    size_t GC::rootsCapacity_ = 0;
 
     size_t GC::rootChanges_ = 0;
 
+    GC::RootRange * GC::rootRanges_ = nullptr;
+
+    namespace {
+
+        std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+
+        uint64_t nanosecondsSince(std::chrono::steady_clock::time_point since) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+        }
+
+        static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "Bitmap words must be usable as atomics");
+
+        /** Sets the bit atomically, returns false if it has been set already.
+         */
+        bool setBitAtomic(uint64_t * bits, size_t i) {
+            uint64_t mask = uint64_t{1} << (i % 64);
+            std::atomic<uint64_t> & word = reinterpret_cast<std::atomic<uint64_t> &>(bits[i / 64]);
+            if (word.load(std::memory_order_relaxed) & mask)
+                return false;
+            return (word.fetch_or(mask, std::memory_order_relaxed) & mask) == 0;
+        }
+
+    } // anonymous namespace
+
     void GC::PrintStats() {
+        uint64_t total = nanosecondsSince(start);
+        uint64_t gcTime = minorTimeNs_ + majorTimeNs_ + sweepTimeNs_;
+        PauseStats pauses = Pauses();
         std::cout << tiny::color::gray;
         std::cout << "Allocations:  " << allocations_ << std::endl;
+        std::cout << "GC cycles:    " << cycles_ << std::endl;
+        std::cout << "Minor cycles: " << minorCycles_ << std::endl;
+        std::cout << "Promoted:     " << promoted_ << std::endl;
+        std::cout << "Region:       " << regionFrames_ << " frames" << std::endl;
+        std::cout << "Minor pauses: " << minorTimeNs_ / 1000 << " us total, " << maxMinorPauseNs_ / 1000 << " us max" << std::endl;
+        std::cout << "Major pauses: " << majorTimeNs_ / 1000 << " us total, " << maxMajorPauseNs_ / 1000 << " us max" << std::endl;
+        std::cout << "Lazy sweep:   " << sweepTimeNs_ / 1000 << " us total, " << maxSweepNs_ / 1000 << " us max" << std::endl;
+        std::cout << "Pauses:       " << pauses.count << ", p50 " << pauses.p50Ns / 1000 << " us, p90 " << pauses.p90Ns / 1000 << " us, p99 " << pauses.p99Ns / 1000 << " us, max " << pauses.maxNs / 1000 << " us" << std::endl;
+        std::cout << "Throughput:   " << (total == 0 ? 100.0 : 100.0 * (total - gcTime) / total) << " % of run time outside GC" << std::endl;
         std::cout << "Live objects: " << liveObjects_ << std::endl;
+        std::cout << "Recovered:    " << recovered_ << std::endl;
         std::cout << "Active banks: " << numBanks_ << std::endl;
+        std::cout << "Heap size:    " << heapSize_ << " cells" << std::endl;
+        std::cout << "Released:     " << releasedBanks_ << " banks" << std::endl;
+        std::cout << "Resident:     " << ResidentBytes() / 1024 << " KiB now, " << PeakResidentBytes() / 1024 << " KiB peak" << std::endl;
+        std::cout << "Roots:        " << numRoots_ << std::endl;
         std::cout << "Root changes: " << rootChanges_ << std::endl;
         std::cout << tiny::color::reset;
     }
 
+    template<typename F>
+    void GC::ForEachRoot(F f) {
+        for (Cell *** i = roots_, *** e = roots_ + numRoots_; i != e; ++i)
+            if (*i != nullptr)
+                f(**i);
+        for (RootRange * r = rootRanges_; r != nullptr; r = r->next)
+            for (Cell ** i = r->begin, ** e = r->end; i != e; ++i)
+                f(*i);
+        for (uintptr_t * x = region_; x != regionTop_; ) {
+            Cell * frame = reinterpret_cast<Cell *>(x);
+            f(frame->parent);
+            for (Cell ** i = frame->slots, ** e = frame->slots + frame->frameSize(); i != e; ++i)
+                f(*i);
+            x += RegionFrameWords(frame->frameSize());
+        }
+    }
+
+    template<typename F>
+    void GC::ForEachChild(Cell * cell, F f) {
+        switch (cell->kind) {
+        case CellKind::Cons:
+        case CellKind::Closure:
+            f(cell->car);
+            f(cell->cdr);
+            break;
+        case CellKind::Frame:
+            f(cell->parent);
+            for (Cell ** i = cell->slots, ** e = cell->slots + cell->frameSize(); i != e; ++i)
+                f(*i);
+            break;
+        default:
+            break;
+        }
+    }
+
     void GC::Run() {
-        Mark();
-        Sweep();
-        if (freeList_ == nullptr) {
-            bank_ = new Bank(bank_, freeList_);
-            ++numBanks_;
-            std::cout << "New bank created..." << std::endl;
+        EvacuateNursery();
+        CollectTenured(true);
+    }
+
+    void GC::CollectTenured(bool requested) {
+        FinishSweep();
+        auto t = std::chrono::steady_clock::now();
+        ++cycles_;
+        size_t used = heapSize_ - freeCells_;
+        if (policy_.mode == Mode::Copying) {
+            Compact();
+        } else {
+            Mark();
+            SweepFrames(false);
+            // all cells that are not marked will be freed by the lazy sweep. The allocation restarts from the first bank as otherwise cells allocated in banks not yet swept would be swept as well
+            for (Bank * b = bank_; b != nullptr; b = b->next)
+                b->unswept = true;
+            allocBank_ = nullptr;
+            freeBits_ = 0;
+            freeCells_ = heapSize_ - liveObjects_;
+        }
+        uint64_t pause = nanosecondsSince(t);
+        RecordPause(EventKind::FullCollection, pause);
+        size_t recovered = used > liveObjects_ ? used - liveObjects_ : 0;
+        recovered_ += recovered;
+        Report(Event{EventKind::FullCollection, pause, allocations_ - majorAllocations_, liveObjects_, recovered, heapSize_});
+        majorAllocations_ = allocations_;
+        // determine whether to grow the heap
+        uint64_t now = nanosecondsSince(start);
+        uint64_t gcTime = minorTimeNs_ + majorTimeNs_ + sweepTimeNs_;
+        double overhead = now == lastMajorEndNs_ ? 1.0 : static_cast<double>(gcTime - lastGcTimeNs_) / (now - lastMajorEndNs_);
+        lastGcTimeNs_ = gcTime;
+        lastMajorEndNs_ = now;
+        if (liveObjects_ > policy_.maxLiveRatio * heapSize_ || (overhead > policy_.targetOverhead && ! requested)) {
+            size_t target = static_cast<size_t>(heapSize_ * policy_.growthFactor);
+            size_t minimum = static_cast<size_t>(liveObjects_ / policy_.maxLiveRatio);
+            if (target < minimum)
+                target = minimum;
+            if (target > heapSize_)
+                Grow(target - heapSize_);
+            surplusCycles_ = 0;
+        } else if (policy_.mode == Mode::MarkSweep) {
+            ReleaseEmptyBanks();
+        }
+    }
+
+    void GC::ReleaseEmptyBanks() {
+        // keep enough space so that the heap would not grow again right away, and so that the nursery can always be promoted
+        size_t keep = std::max(policy_.initialHeapSize, static_cast<size_t>(liveObjects_ * policy_.growthFactor / policy_.maxLiveRatio));
+        keep = std::max(keep, liveObjects_ + nurserySize_);
+        if (policy_.releaseAfter == 0 || heapSize_ < keep + bankCells_) {
+            surplusCycles_ = 0;
+            return;
+        }
+        if (++surplusCycles_ < policy_.releaseAfter)
+            return;
+        surplusCycles_ = 0;
+        size_t released = 0;
+        for (Bank ** b = & bank_; *b != nullptr && heapSize_ >= keep + bankCells_; ) {
+            Bank * x = *b;
+            bool empty = true;
+            for (size_t i = 0; empty && i < bitmapWords_; ++i)
+                empty = x->markBits[i] == 0;
+            if (empty) {
+                *b = x->next;
+                Bank::Release(x);
+                --numBanks_;
+                heapSize_ -= bankCells_;
+                freeCells_ -= bankCells_;
+                ++released;
+            } else {
+                b = & x->next;
+            }
+        }
+        releasedBanks_ += released;
+        if (released > 0)
+            Report(Event{EventKind::HeapShrunk, 0, 0, liveObjects_, 0, heapSize_});
+    }
+
+    GC::Cell * GC::AllocateSlow() {
+        if (! initialized_)
+            Initialize();
+        if (nurserySize_ == 0) {
+            if (freeBits_ == 0 && ! NextFreeCells())
+                CollectTenured();
+            return AllocateTenured();
+        }
+        CollectNursery();
+        return nurseryTop_++;
+    }
+
+    void GC::Initialize() {
+        Configure(HeapPolicy::FromEnvironment());
+    }
+
+    void GC::Configure(HeapPolicy const & policy) {
+        initialized_ = true;
+        policy_ = policy;
+        if (policy_.bankSize == 0)
+            policy_.bankSize = 1;
+        if (nurserySize_ != policy_.nurserySize)
+            SetNurserySize(policy_.nurserySize);
+        // frames in the region cannot be moved
+        if (regionTop_ == region_ && static_cast<size_t>(regionEnd_ - region_) != policy_.regionSize * sizeof(Cell) / sizeof(uintptr_t))
+            SetRegionSize(policy_.regionSize);
+        if (heapSize_ < policy_.initialHeapSize)
+            Grow(policy_.initialHeapSize - heapSize_);
+    }
+
+    GC::HeapPolicy GC::HeapPolicy::FromEnvironment() {
+        HeapPolicy result;
+        fromEnvironment("SECD_GC_INITIAL_HEAP", result.initialHeapSize);
+        fromEnvironment("SECD_GC_MAX_HEAP", result.maxHeapSize);
+        fromEnvironment("SECD_GC_BANK_SIZE", result.bankSize);
+        fromEnvironment("SECD_GC_NURSERY", result.nurserySize);
+        fromEnvironment("SECD_GC_REGION", result.regionSize);
+        fromEnvironment("SECD_GC_GROWTH_FACTOR", result.growthFactor);
+        fromEnvironment("SECD_GC_MAX_LIVE_RATIO", result.maxLiveRatio);
+        fromEnvironment("SECD_GC_TARGET_OVERHEAD", result.targetOverhead);
+        fromEnvironment("SECD_GC_MARK_THREADS", result.markThreads);
+        fromEnvironment("SECD_GC_RELEASE_AFTER", result.releaseAfter);
+        fromEnvironment("SECD_GC_HUGE_PAGES", result.hugePages);
+        fromEnvironment("SECD_GC_LOG", result.log);
+        std::string mode;
+        fromEnvironment("SECD_GC_MODE", mode);
+        if (mode == "copying")
+            result.mode = Mode::Copying;
+        else if (mode == "marksweep")
+            result.mode = Mode::MarkSweep;
+        return result;
+    }
+
+    bool GC::Grow(size_t cells) {
+        size_t grown = 0;
+        if (bankBytes_ == 0)
+            SetupBanks();
+        while (grown < cells && (policy_.maxHeapSize == 0 || heapSize_ + bankCells_ <= policy_.maxHeapSize)) {
+            AddBank();
+            grown += bankCells_;
+        }
+        if (grown == 0)
+            return false;
+        Report(Event{EventKind::HeapGrown, 0, 0, liveObjects_, 0, heapSize_});
+        return true;
+    }
+
+    void GC::SetNurserySize(size_t cells) {
+        if (nursery_ != nullptr) {
+            EvacuateNursery();
+            delete [] reinterpret_cast<char *>(nursery_);
+            delete [] nurseryForwarded_;
+            nursery_ = nurseryTop_ = nurseryEnd_ = nullptr;
+            nurseryForwarded_ = nullptr;
+        }
+        nurserySize_ = cells;
+    }
+
+    GC::Cell * GC::NewFrame(Cell * const & parent, size_t size) {
+        Cell * result = static_cast<Cell *>(AllocateCell());
+        size_t * block = static_cast<size_t *>(malloc(sizeof(size_t) + sizeof(Cell *) * size));
+        if (block == nullptr)
+            throw std::bad_alloc();
+        block[0] = size;
+        result->kind = CellKind::Frame;
+        result->slots = reinterpret_cast<Cell **>(block + 1);
+        result->parent = parent;
+        for (size_t i = 0; i < size; ++i)
+            result->slots[i] = MakeImmediate(0);
+        (IsYoung(result) ? youngFrames_ : frames_).push_back(result);
+        return result;
+    }
+
+    void GC::ResizeFrame(Cell * frame, size_t size) {
+        assert(frame->kind == CellKind::Frame && "Resizing non-frame cell");
+        assert(! InRegion(frame) && "Frames in the region cannot be resized");
+        size_t old = frame->frameSize();
+        size_t * block = static_cast<size_t *>(realloc(reinterpret_cast<size_t *>(frame->slots) - 1, sizeof(size_t) + sizeof(Cell *) * size));
+        if (block == nullptr)
+            throw std::bad_alloc();
+        block[0] = size;
+        frame->slots = reinterpret_cast<Cell **>(block + 1);
+        for (size_t i = old; i < size; ++i)
+            frame->slots[i] = MakeImmediate(0);
+    }
+
+    GC::Cell * GC::NewRegionFrameSlow(Cell * const & parent, size_t size) {
+        if (! initialized_) {
+            Initialize();
+            if (static_cast<size_t>(regionEnd_ - regionTop_) >= RegionFrameWords(size))
+                return NewRegionFrame(parent, size);
+        }
+        return NewFrame(parent, size);
+    }
+
+    void GC::SetRegionSize(size_t cells) {
+        assert(regionTop_ == region_ && "Only empty region can be resized");
+        delete [] region_;
+        region_ = regionTop_ = regionEnd_ = nullptr;
+        if (cells != 0) {
+            size_t words = cells * sizeof(Cell) / sizeof(uintptr_t);
+            region_ = regionTop_ = new uintptr_t[words];
+            regionEnd_ = region_ + words;
+        }
+    }
+
+    void GC::SweepYoungFrames() {
+        for (Cell * c : youngFrames_) {
+            if (TestBit(nurseryForwarded_, c - nursery_))
+                frames_.push_back(c->car);
+            else
+                FreeSlots(c);
+        }
+        youngFrames_.clear();
+    }
+
+    void GC::SweepFrames(bool copied) {
+        size_t n = 0;
+        for (Cell * c : frames_) {
+            Bank * b = Bank::Of(c);
+            if (! TestBit(b->markBits, b->indexOf(c)))
+                FreeSlots(c);
+            else
+                frames_[n++] = copied ? c->car : c;
+        }
+        frames_.resize(n);
+    }
+
+    void GC::WriteBarrier(Cell * target, Cell * value) {
+        // frames in the region are scanned as roots by every collection
+        if (IsYoung(value) && ! IsYoung(target) && ! InRegion(target)) {
+            Bank * b = Bank::Of(target);
+            size_t i = b->indexOf(target);
+            if (! TestBit(b->rememberedBits, i)) {
+                SetBit(b->rememberedBits, i);
+                remembered_.push_back(target);
+            }
+        }
+    }
+
+    bool GC::NextFreeCells() {
+        Bank * b = allocBank_;
+        size_t w = allocWord_ + 1;
+        if (b == nullptr) {
+            b = bank_;
+            w = 0;
+        }
+        while (b != nullptr) {
+            if (b->unswept)
+                Sweep(b);
+            for (; w < bitmapWords_; ++w) {
+                if (~b->allocBits[w] != 0) {
+                    allocBank_ = b;
+                    allocWord_ = w;
+                    freeBits_ = ~b->allocBits[w];
+                    return true;
+                }
+            }
+            // stay at the last bank when exhausted so that new banks are added after it
+            allocBank_ = b;
+            allocWord_ = bitmapWords_;
+            b = b->next;
+            w = 0;
         }
-        allocations_ = 0;
+        return false;
+    }
+
+    void GC::AddBank() {
+        if (bankBytes_ == 0)
+            SetupBanks();
+        if (policy_.maxHeapSize != 0 && heapSize_ + bankCells_ > policy_.maxHeapSize)
+            throw std::bad_alloc();
+        if (allocBank_ == nullptr) {
+            bank_ = Bank::Create(bank_);
+        } else {
+            allocBank_->next = Bank::Create(allocBank_->next);
+        }
+        ++numBanks_;
+        heapSize_ += bankCells_;
+        freeCells_ += bankCells_;
+    }
+
+    void GC::SetupBanks() {
+        bankBytes_ = 4096;
+        while (true) {
+            bitmapWords_ = (bankBytes_ / sizeof(Cell) + 63) / 64;
+            bankCells_ = (bankBytes_ - sizeof(Bank) - 3 * sizeof(uint64_t) * bitmapWords_) / sizeof(Cell);
+            if (bankCells_ >= policy_.bankSize)
+                break;
+            bankBytes_ *= 2;
+        }
+        // the bitmaps were sized for a bank without header so they may be a word longer than necessary
+        bitmapWords_ = (bankCells_ + 63) / 64;
+    }
+
+    void GC::CreateNursery() {
+        nursery_ = reinterpret_cast<Cell *>(new char[sizeof(Cell) * nurserySize_]);
+        nurseryForwarded_ = new uint64_t[(nurserySize_ + 63) / 64]();
+        nurseryTop_ = nursery_;
+        nurseryEnd_ = nursery_ + nurserySize_;
+    }
+
+    void GC::CollectNursery() {
+        if (nursery_ == nullptr) {
+            CreateNursery();
+            return;
+        }
+        EvacuateNursery();
+        // make sure the next minor collection can promote the whole nursery without growing the heap
+        if (freeCells_ < nurserySize_) {
+            CollectTenured();
+            if (freeCells_ < nurserySize_)
+                Grow(nurserySize_ - freeCells_);
+        }
+    }
+
+    void GC::EvacuateNursery() {
+        if (nursery_ == nullptr)
+            return;
+        auto t = std::chrono::steady_clock::now();
+        ++minorCycles_;
+        size_t used = nurseryTop_ - nursery_;
+        size_t promoted = promoted_;
+        // roots
+        ForEachRoot([](Cell * & root) {
+            root = Promote(root);
+        });
+        // tenured cells pointing to the nursery
+        for (Cell * c : remembered_) {
+            Bank * b = Bank::Of(c);
+            ClearBit(b->rememberedBits, b->indexOf(c));
+            ForEachChild(c, [](Cell * & child) {
+                child = Promote(child);
+            });
+        }
+        remembered_.clear();
+        // contents of the promoted cells, which may promote further cells
+        while (! promotedQueue_.empty()) {
+            Cell * c = promotedQueue_.back();
+            promotedQueue_.pop_back();
+            ForEachChild(c, [](Cell * & child) {
+                child = Promote(child);
+            });
+        }
+        SweepYoungFrames();
+        memset(nurseryForwarded_, 0, sizeof(uint64_t) * ((nurseryTop_ - nursery_ + 63) / 64));
+        nurseryTop_ = nursery_;
+        uint64_t pause = nanosecondsSince(t);
+        RecordPause(EventKind::MinorCollection, pause);
+        promoted = promoted_ - promoted;
+        recovered_ += used - promoted;
+        Report(Event{EventKind::MinorCollection, pause, allocations_ - minorAllocations_, promoted, used - promoted, heapSize_});
+        minorAllocations_ = allocations_;
+    }
+
+    GC::Cell * GC::Promote(Cell * cell) {
+        if (! IsYoung(cell))
+            return cell;
+        size_t i = cell - nursery_;
+        if (TestBit(nurseryForwarded_, i))
+            return cell->car;
+        Cell * result = AllocateTenured();
+        result->kind = cell->kind;
+        result->car = cell->car;
+        result->cdr = cell->cdr;
+        SetBit(nurseryForwarded_, i);
+        cell->car = result;
+        ++promoted_;
+        if (result->kind != CellKind::Integer && result->kind != CellKind::Symbol)
+            promotedQueue_.push_back(result);
+        return result;
     }
 
     void GC::Mark() {
+        size_t threads = policy_.markThreads == 0 ? std::thread::hardware_concurrency() : policy_.markThreads;
+        if (threads > 1) {
+            MarkParallel(threads);
+            return;
+        }
         liveObjects_ = 0;
         std::vector<Cell *> q;
-        for (auto i : roots_)
-            q.push_back(*i);
+        ForEachRoot([& q](Cell * root) {
+            q.push_back(root);
+        });
         while (!q.empty()) {
             Cell * x = q.back();
             q.pop_back();
-            if (x->status == CellStatus::Marked)
+            // immediate integers are not cells and need no marking, the slots of the frames in the region are roots
+            if (IsImmediate(x) || InRegion(x))
                 continue;
-            x->status = CellStatus::Marked;
+            Bank * b = Bank::Of(x);
+            size_t i = b->indexOf(x);
+            if (TestBit(b->markBits, i))
+                continue;
+            SetBit(b->markBits, i);
             ++liveObjects_;
-            switch (x->kind) {
-            case CellKind::Cons:
-                q.push_back(x->car);
-                q.push_back(x->cdr);
+            ForEachChild(x, [& q](Cell * child) {
+                q.push_back(child);
+            });
+        }
+    }
+
+    /** Cells to be scanned are kept on a private stack. When the private stack is large enough and the shared stack of the marker is empty, the older half of the private stack is moved to the shared one, where other markers can steal from.
+     */
+    class GC::Marker {
+    public:
+
+        /** Minimal size of the private stack to share work from.
+         */
+        static size_t constexpr ShareThreshold = 64;
+
+        /** Marks until there is no work left in any of the markers.
+         */
+        void run(Marker * markers, size_t count, std::atomic<size_t> & idle) {
+            while (true) {
+                while (! local.empty()) {
+                    Cell * x = local.back();
+                    local.pop_back();
+                    if (IsImmediate(x) || InRegion(x))
+                        continue;
+                    Bank * b = Bank::Of(x);
+                    if (! setBitAtomic(b->markBits, b->indexOf(x)))
+                        continue;
+                    ++marked;
+                    ForEachChild(x, [this](Cell * child) {
+                        local.push_back(child);
+                    });
+                    if (local.size() >= ShareThreshold && sharedSize.load(std::memory_order_relaxed) == 0)
+                        share();
+                }
+                if (takeFrom(*this) || steal(markers, count))
+                    continue;
+                // nobody publishes work once all markers are idle as only markers with work do and each marker takes back its own shared work before it becomes idle
+                ++idle;
+                while (idle != count && ! hasWork(markers, count))
+                    std::this_thread::yield();
+                if (idle == count)
+                    return;
+                --idle;
+            }
+        }
+
+        std::vector<Cell *> local;
+
+        std::vector<Cell *> shared;
+
+        std::atomic<size_t> sharedSize{0};
+
+        std::mutex lock;
+
+        /** Number of cells marked by the marker.
+         */
+        size_t marked = 0;
+
+    private:
+
+        void share() {
+            std::lock_guard<std::mutex> g(lock);
+            size_t half = local.size() / 2;
+            shared.insert(shared.end(), local.begin(), local.begin() + half);
+            local.erase(local.begin(), local.begin() + half);
+            sharedSize = shared.size();
+        }
+
+        /** Moves shared cells of the victim to the private stack, all of them if the victim is this marker, half otherwise.
+         */
+        bool takeFrom(Marker & victim) {
+            if (victim.sharedSize.load(std::memory_order_relaxed) == 0)
+                return false;
+            std::lock_guard<std::mutex> g(victim.lock);
+            size_t n = & victim == this ? victim.shared.size() : (victim.shared.size() + 1) / 2;
+            local.insert(local.end(), victim.shared.end() - n, victim.shared.end());
+            victim.shared.resize(victim.shared.size() - n);
+            victim.sharedSize = victim.shared.size();
+            return n > 0;
+        }
+
+        bool steal(Marker * markers, size_t count) {
+            for (size_t i = 0; i < count; ++i)
+                if (& markers[i] != this && takeFrom(markers[i]))
+                    return true;
+            return false;
+        }
+
+        static bool hasWork(Marker * markers, size_t count) {
+            for (size_t i = 0; i < count; ++i)
+                if (markers[i].sharedSize != 0)
+                    return true;
+            return false;
+        }
+    }; // GC::Marker
+
+    void GC::MarkParallel(size_t threads) {
+        std::unique_ptr<Marker[]> markers(new Marker[threads]);
+        size_t n = 0;
+        ForEachRoot([&](Cell * root) {
+            markers[n++ % threads].local.push_back(root);
+        });
+        std::atomic<size_t> idle(0);
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < threads; ++i)
+            workers.emplace_back([&, i]() {
+                markers[i].run(markers.get(), threads, idle);
+            });
+        markers[0].run(markers.get(), threads, idle);
+        for (std::thread & t : workers)
+            t.join();
+        liveObjects_ = 0;
+        for (size_t i = 0; i < threads; ++i)
+            liveObjects_ += markers[i].marked;
+    }
+
+    void GC::Compact() {
+        Bank * from = bank_;
+        liveObjects_ = 0;
+        // copy the roots and then the contents of the copied cells in the order they were copied
+        ForEachRoot([](Cell * & root) {
+            root = Copy(root);
+        });
+        for (size_t i = 0; i < toSpace_.size(); ++i) {
+            Bank * b = toSpace_[i];
+            for (Cell * c = b->cells; c != (b == toSpace_.back() ? copyTop_ : b->cells + bankCells_); ++c) {
+                ForEachChild(c, [](Cell * & child) {
+                    child = Copy(child);
+                });
+            }
+        }
+        // the mark bits of the old banks tell which frames were copied
+        SweepFrames(true);
+        // release the old banks
+        while (from != nullptr) {
+            Bank * b = from;
+            from = from->next;
+            Bank::Release(b);
+        }
+        // the copied cells now form the heap, the allocation continues in the last bank
+        bank_ = nullptr;
+        numBanks_ = 0;
+        heapSize_ = 0;
+        for (Bank * b : toSpace_) {
+            b->toSpace = false;
+            b->next = bank_;
+            bank_ = b;
+            ++numBanks_;
+            heapSize_ += bankCells_;
+        }
+        allocBank_ = nullptr;
+        freeBits_ = 0;
+        freeCells_ = heapSize_ - liveObjects_;
+        toSpace_.clear();
+        copyTop_ = copyEnd_ = nullptr;
+    }
+
+    GC::Cell * GC::Copy(Cell * cell) {
+        if (IsImmediate(cell) || InRegion(cell))
+            return cell;
+        Bank * b = Bank::Of(cell);
+        if (b->toSpace)
+            return cell;
+        if (TestBit(b->markBits, b->indexOf(cell)))
+            return cell->car;
+        Cell * result = CopyCell(cell);
+        // copy the spine of the list right after its head
+        Cell * last = result;
+        while (last->kind == CellKind::Cons && ! IsImmediate(last->cdr) && last->cdr->kind == CellKind::Cons && ! Bank::Of(last->cdr)->toSpace && ! TestBit(Bank::Of(last->cdr)->markBits, Bank::Of(last->cdr)->indexOf(last->cdr))) {
+            last->cdr = CopyCell(last->cdr);
+            last = last->cdr;
+        }
+        return result;
+    }
+
+    GC::Cell * GC::CopyCell(Cell * cell) {
+        if (copyTop_ == copyEnd_) {
+            Bank * b = Bank::Create(nullptr);
+            b->toSpace = true;
+            toSpace_.push_back(b);
+            copyTop_ = b->cells;
+            copyEnd_ = b->cells + bankCells_;
+        }
+        Bank * to = toSpace_.back();
+        Cell * result = copyTop_++;
+        SetBit(to->allocBits, to->indexOf(result));
+        result->kind = cell->kind;
+        result->car = cell->car;
+        result->cdr = cell->cdr;
+        Bank * from = Bank::Of(cell);
+        SetBit(from->markBits, from->indexOf(cell));
+        cell->car = result;
+        ++liveObjects_;
+        return result;
+    }
+
+    void GC::Sweep(Bank * bank) {
+        auto t = std::chrono::steady_clock::now();
+        uint64_t * alloc = bank->allocBits;
+        uint64_t * mark = bank->markBits;
+        // only the bitmaps are touched, simple enough for the compiler to vectorize
+        for (size_t i = 0; i < bitmapWords_; ++i) {
+            alloc[i] = mark[i];
+            mark[i] = 0;
+        }
+        if (bankCells_ % 64 != 0)
+            alloc[bitmapWords_ - 1] |= ~uint64_t{0} << (bankCells_ % 64);
+        bank->unswept = false;
+        uint64_t time = nanosecondsSince(t);
+        sweepTimeNs_ += time;
+        if (time > maxSweepNs_)
+            maxSweepNs_ = time;
+    }
+
+    void GC::FinishSweep() {
+        for (Bank * b = bank_; b != nullptr; b = b->next)
+            if (b->unswept)
+                Sweep(b);
+    }
+
+    void GC::RecordPause(EventKind kind, uint64_t ns) {
+        size_t bucket = 0;
+        while (bucket < HistogramBuckets - 1 && (ns >> (bucket + 1)) != 0)
+            ++bucket;
+        if (kind == EventKind::MinorCollection) {
+            minorTimeNs_ += ns;
+            maxMinorPauseNs_ = std::max(maxMinorPauseNs_, ns);
+            ++minorHistogram_[bucket];
+        } else {
+            majorTimeNs_ += ns;
+            maxMajorPauseNs_ = std::max(maxMajorPauseNs_, ns);
+            ++majorHistogram_[bucket];
+        }
+        pauses_[numPauses_ % PauseHistory] = ns;
+        ++numPauses_;
+    }
+
+    void GC::Report(Event const & event) {
+        if (policy_.log) {
+            switch (event.kind) {
+            case EventKind::MinorCollection:
+                std::cout << "GC Minor: allocations " << event.allocated << ", promoted: " << event.live << ", pause " << event.pauseNs / 1000 << " us" << std::endl;
                 break;
-            case CellKind::Closure:
-                q.push_back(x->car);
-                q.push_back(x->cdr);
-            default:
+            case EventKind::FullCollection:
+                std::cout << "GC Run: allocations " << event.allocated << ", live objects: " << event.live << ", pause " << event.pauseNs / 1000 << " us" << std::endl;
+                break;
+            case EventKind::HeapGrown:
+                std::cout << "Heap grown to " << event.heapSize << " cells..." << std::endl;
+                break;
+            case EventKind::HeapShrunk:
+                std::cout << "Heap shrunk to " << event.heapSize << " cells..." << std::endl;
                 break;
             }
         }
+        for (auto const & l : listeners_)
+            l.second(event);
     }
 
-    void GC::Sweep() {
-        Bank * b = bank_;
-        size_t recovered = 0;
-        while (b != nullptr) {
-            for (Cell * c = b->cells, * e = b->cells + BankSize; c != e; ++c) {
-                switch (c->status) {
-                case CellStatus::Marked:
-                    c->status = CellStatus::Used;
-                    break;
-                case CellStatus::Used:
-                    c->car = freeList_;
-                    freeList_ = c;
-                    c->status = CellStatus::Free;
-                    ++recovered;
-                    break;
-                default:
-                    break;
-                }
+    size_t GC::AddListener(Listener listener) {
+        listeners_.push_back(std::make_pair(nextListenerId_, std::move(listener)));
+        return nextListenerId_++;
+    }
+
+    void GC::RemoveListener(size_t id) {
+        for (auto i = listeners_.begin(), e = listeners_.end(); i != e; ++i) {
+            if (i->first == id) {
+                listeners_.erase(i);
+                return;
             }
-            b = b->next;
         }
-        std::cout << "GC Run: allocations " << allocations_ << ", live objects: " << liveObjects_ << ", recovered " << recovered << std::endl;
     }
-    
-    GC::Bank::Bank(GC::Bank * next, GC::Cell * & freeList):
-        next(next) {
-        // create the memory 
-        char * rawMem = (new char[sizeof (GC::Cell) * GC::BankSize]);
-        memset(rawMem, 0xff, sizeof(GC::Cell) * GC::BankSize);
-        cells = reinterpret_cast<Cell *>(rawMem);
-        // the last cell in the bank should point to the existing free list
-        cells[GC::BankSize - 1].car = freeList;
-        // and the free list now points to the first cell in the benk
-        freeList = cells;
+
+    GC::Stats GC::Statistics() {
+        Stats result;
+        result.cycles = cycles_;
+        result.minorCycles = minorCycles_;
+        result.allocations = allocations_;
+        result.allocatedBytes = allocations_ * sizeof(Cell);
+        result.promoted = promoted_;
+        result.regionFrames = regionFrames_;
+        result.live = liveObjects_;
+        result.recovered = recovered_;
+        result.banks = numBanks_;
+        result.heapSize = heapSize_;
+        result.releasedBanks = releasedBanks_;
+        result.roots = numRoots_;
+        result.rootChanges = rootChanges_;
+        result.residentBytes = ResidentBytes();
+        result.minorTimeNs = minorTimeNs_;
+        result.majorTimeNs = majorTimeNs_;
+        result.sweepTimeNs = sweepTimeNs_;
+        result.maxMinorPauseNs = maxMinorPauseNs_;
+        result.maxMajorPauseNs = maxMajorPauseNs_;
+        std::copy(minorHistogram_, minorHistogram_ + HistogramBuckets, result.minorPauses);
+        std::copy(majorHistogram_, majorHistogram_ + HistogramBuckets, result.majorPauses);
+        return result;
+    }
+
+    GC::PauseStats GC::Pauses() {
+        PauseStats result;
+        result.count = numPauses_;
+        result.maxNs = std::max(maxMinorPauseNs_, maxMajorPauseNs_);
+        std::vector<uint64_t> recent(pauses_, pauses_ + std::min(numPauses_, PauseHistory));
+        if (recent.empty()) {
+            result.p50Ns = result.p90Ns = result.p99Ns = 0;
+        } else {
+            std::sort(recent.begin(), recent.end());
+            result.p50Ns = recent[(recent.size() - 1) * 50 / 100];
+            result.p90Ns = recent[(recent.size() - 1) * 90 / 100];
+            result.p99Ns = recent[(recent.size() - 1) * 99 / 100];
+        }
+        return result;
+    }
+
+    void GC::GrowRoots() {
+        rootsCapacity_ = rootsCapacity_ == 0 ? 1024 : rootsCapacity_ * 2;
+        roots_ = static_cast<Cell ***>(realloc(roots_, sizeof(Cell **) * rootsCapacity_));
+        if (roots_ == nullptr)
+            throw std::bad_alloc();
+    }
+
+    GC::Bank * GC::Bank::Create(GC::Bank * next) {
+        if (bankBytes_ == 0)
+            SetupBanks();
+        void * block = AllocateBlock();
+        Bank * result = new (block) Bank();
+        result->next = next;
+        // the bitmaps directly follow the header and the cells follow the bitmaps
+        uint64_t * bits = reinterpret_cast<uint64_t *>(result + 1);
+        memset(bits, 0, 3 * sizeof(uint64_t) * bitmapWords_);
+        result->markBits = bits;
+        result->allocBits = bits + bitmapWords_;
+        result->rememberedBits = bits + 2 * bitmapWords_;
+        result->cells = reinterpret_cast<Cell *>(bits + 3 * bitmapWords_);
+        if (bankCells_ % 64 != 0)
+            result->allocBits[bitmapWords_ - 1] = ~uint64_t{0} << (bankCells_ % 64);
+        result->unswept = false;
+        result->toSpace = false;
+        return result;
+    }
+
+    void GC::Bank::Release(GC::Bank * bank) {
+        bank->~Bank();
+        ReleaseBlock(bank);
+    }
+
+#if defined(__linux__)
+
+    void * GC::AllocateBlock() {
+        if (freeBlocks_.empty()) {
+            // map twice the chunk size so that an aligned chunk can be cut out of it
+            size_t chunk = std::max(ChunkBytes, bankBytes_);
+            char * raw = static_cast<char *>(mmap(nullptr, 2 * chunk, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (raw == MAP_FAILED)
+                throw std::bad_alloc();
+            char * aligned = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(raw) + chunk - 1) & ~(chunk - 1));
+            if (aligned != raw)
+                munmap(raw, aligned - raw);
+            if (aligned + chunk != raw + 2 * chunk)
+                munmap(aligned + chunk, raw + 2 * chunk - (aligned + chunk));
+#if defined(MADV_HUGEPAGE)
+            if (policy_.hugePages)
+                madvise(aligned, chunk, MADV_HUGEPAGE);
+#endif
+            // the first bank of the chunk is used first
+            for (size_t i = chunk; i > 0; i -= bankBytes_)
+                freeBlocks_.push_back(aligned + i - bankBytes_);
+        }
+        void * result = freeBlocks_.back();
+        freeBlocks_.pop_back();
+        return result;
+    }
+
+    void GC::ReleaseBlock(void * block) {
+        // the pages are dropped, but the address range stays mapped and reads as zeroes when reused
+        madvise(block, bankBytes_, MADV_DONTNEED);
+        freeBlocks_.push_back(block);
     }
 
+    size_t GC::ResidentBytes() {
+        std::ifstream f("/proc/self/statm");
+        size_t size = 0;
+        size_t resident = 0;
+        if (! (f >> size >> resident))
+            return 0;
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    size_t GC::PeakResidentBytes() {
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, & usage) != 0)
+            return 0;
+        // reported in kilobytes
+        return usage.ru_maxrss * 1024;
+    }
+
+#else
+
+    void * GC::AllocateBlock() {
+        void * result = aligned_alloc(bankBytes_, bankBytes_);
+        if (result == nullptr)
+            throw std::bad_alloc();
+        return result;
+    }
+
+    void GC::ReleaseBlock(void * block) {
+        free(block);
+    }
+
+    size_t GC::ResidentBytes() {
+        return 0;
+    }
+
+    size_t GC::PeakResidentBytes() {
+        return 0;
+    }
+
+#endif
+
 } // namespace secd
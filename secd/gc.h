@@ -1,49 +1,309 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <ostream>
-#include <unordered_set>
 #include <functional>
+#include <sstream>
+#include <type_traits>
+#include <vector>
 
 namespace secd {
 
-    /** Very simple mark-sweep garbage collector.
+    /** Sets the value from the environment variable of the given name.
 
-        Super simple allocation if memory is available: return the top of the free list, advance free list to the next element.
-        If free list is empty, perform garbage collection, which also determines which banks should be returned to the OS, if any.
+        The value is left unchanged if the variable is not set, or if it is not a valid value of the type as a whole. Negative numbers are not valid for unsigned types, which would otherwise wrap around. The settings read from the environment therefore never fail, invalid ones are ignored.
+     */
+    template<typename T>
+    void fromEnvironment(char const * name, T & value) {
+        char const * x = getenv(name);
+        if (x == nullptr || *x == 0)
+            return;
+        if (std::is_unsigned<T>::value && strchr(x, '-') != nullptr)
+            return;
+        std::stringstream s(x);
+        T result;
+        if (s >> result && (s >> std::ws).eof())
+            value = result;
+    }
 
-        => global free list
-        
+    /** Very simple generational garbage collector.
+
+        New cells are bump-allocated in a nursery. When the nursery is full, a minor collection copies the cells reachable from the roots and from the remembered set into the tenured space and the nursery is reused from its beginning. Writes to existing cells go through a write barrier which remembers tenured cells pointing to the nursery.
+
+        The tenured space is managed by a mark-sweep collector. The mark and allocation state of the tenured cells is not stored in the cells themselves, but in bitmaps at the beginning of each bank. Allocation takes the lowest free cell of the current bitmap word using find-first-set, and moves to the next word with a free cell when the word is exhausted.
+        If the current bank is exhausted, the next bank is swept if it has not been swept since the last mark phase. Sweeping a bank only replaces its allocation bitmap with the mark bitmap word by word, without touching the cells. Only if all banks have been swept, perform garbage collection, which also determines which banks should be returned to the OS, if any. The pause therefore only depends on the amount of live data.
+
+        Banks are carved out of larger chunks of memory mapped from the OS, optionally backed by transparent huge pages. Memory of released banks is returned to the OS, but the address space is kept for the banks created later.
+
+        Setting the nursery size to 0 disables the nursery and all cells are allocated directly from the banks.
      */
     class GC {
-    private:
-        enum class CellStatus : unsigned char {
-            Used = 0,
-            Marked = 1,
-            Free = 0xff
-        };
     public:
 
-        static size_t constexpr BankSize = 1000;
+        static size_t constexpr DefaultNurserySize = 16384;
+
+        static size_t constexpr DefaultRegionSize = 262144;
+
+        /** Collection algorithm of the tenured space.
+
+            MarkSweep leaves live cells in place and lazily sweeps the rest. Copying evacuates all live cells into fresh banks, copying the spine of each list right after its head so that lists end up contiguous, and releases the old banks.
+         */
+        enum class Mode {
+            MarkSweep,
+            Copying,
+        }; // GC::Mode
+
+        /** Heap sizing policy.
+
+            All sizes are in cells, a frame in the frame region takes the space of one cell and a word for its size and each of its slots. The bank size is rounded up so that a bank with its bitmaps fills a power of two bytes and cannot change once the first bank has been created. After each full collection the tenured space grows by growthFactor if more than maxLiveRatio of it is live, or if more than targetOverhead of the run time since the previous full collection has been spent in the GC. The tenured space never grows past maxHeapSize, in which case the allocation throws std::bad_alloc. In the copying mode the heap may temporarily use twice the live size during the collection.
+
+            Unless configured from code, the policy is read from the environment when the first cell is allocated, see FromEnvironment().
+         */
+        struct HeapPolicy {
+            size_t initialHeapSize = 65536;
+            size_t maxHeapSize = 0;
+            size_t bankSize = 4096;
+            size_t nurserySize = DefaultNurserySize;
+            size_t regionSize = DefaultRegionSize;
+            double growthFactor = 2.0;
+            double maxLiveRatio = 0.5;
+            double targetOverhead = 0.05;
+            Mode mode = Mode::MarkSweep;
+
+            /** Number of threads marking the tenured space in the mark-sweep mode, 0 uses all hardware threads.
+             */
+            size_t markThreads = 1;
+
+            /** Number of consecutive full collections after which empty banks in excess of what the live data need are returned to the OS, 0 never returns them.
+
+                The heap keeps growthFactor times the size at which it would grow, so that it does not oscillate.
+             */
+            size_t releaseAfter = 3;
+
+            /** Requests transparent huge pages for the chunks the banks are created from.
+             */
+            bool hugePages = false;
+
+            /** Prints every GC event to std::cout.
+             */
+            bool log = false;
+
+            /** Returns the default policy updated by any of the following environment variables: SECD_GC_INITIAL_HEAP, SECD_GC_MAX_HEAP (0 for unlimited), SECD_GC_BANK_SIZE, SECD_GC_NURSERY (0 disables the nursery), SECD_GC_REGION (0 disables the frame region), SECD_GC_GROWTH_FACTOR, SECD_GC_MAX_LIVE_RATIO, SECD_GC_TARGET_OVERHEAD, SECD_GC_MODE (marksweep or copying), SECD_GC_MARK_THREADS, SECD_GC_RELEASE_AFTER, SECD_GC_HUGE_PAGES (0 or 1) and SECD_GC_LOG (0 or 1).
+             */
+            static HeapPolicy FromEnvironment();
+        }; // GC::HeapPolicy
         
         enum class CellKind {
             Integer,
             Symbol,
             Cons,
             Closure,
+            Frame,
         }; // GC::CellKind
 
+        class Cell;
+
+        /** Integers that fit in 63 bits are never allocated. Instead they are stored directly in the cell pointer, with the lowest bit set as a tag. Real cells are always at least 8 byte aligned so the lowest bit of a valid cell pointer is always 0.
+         */
+        static uintptr_t constexpr ImmediateTag = 1;
+
+        static int64_t constexpr MinImmediate = INT64_MIN >> 1;
+        static int64_t constexpr MaxImmediate = INT64_MAX >> 1;
+
+        static bool IsImmediate(Cell const * cell) {
+            return reinterpret_cast<uintptr_t>(cell) & ImmediateTag;
+        }
+
+        static bool FitsImmediate(int64_t value) {
+            return value >= MinImmediate && value <= MaxImmediate;
+        }
+
+        static Cell * MakeImmediate(int64_t value) {
+            assert(FitsImmediate(value) && "Value too large for immediate integer");
+            return reinterpret_cast<Cell *>((static_cast<uintptr_t>(value) << 1) | ImmediateTag);
+        }
+
+        static int64_t ImmediateValue(Cell const * cell) {
+            assert(IsImmediate(cell) && "Not an immediate integer");
+            return static_cast<int64_t>(reinterpret_cast<uintptr_t>(cell)) >> 1;
+        }
+
         static void PrintStats();
 
+        /** Statistics of the GC pauses.
+
+            The maximum is over the whole program run, the percentiles are over the last PauseHistory pauses.
+         */
+        struct PauseStats {
+            size_t count;
+            uint64_t maxNs;
+            uint64_t p50Ns;
+            uint64_t p90Ns;
+            uint64_t p99Ns;
+        }; // GC::PauseStats
+
+        static size_t constexpr PauseHistory = 1024;
+
+        /** Returns the statistics of both minor and full collection pauses.
+         */
+        static PauseStats Pauses();
+
+        static size_t constexpr HistogramBuckets = 40;
+
+        /** Cumulative statistics since the program start.
+
+            The pause histograms count the pauses by the binary logarithm of their length, i.e. bucket i counts the pauses of at least 2^i and less than 2^(i+1) nanoseconds. The last bucket also counts all longer pauses.
+         */
+        struct Stats {
+            size_t cycles;
+            size_t minorCycles;
+            size_t allocations;
+            size_t allocatedBytes;
+            size_t promoted;
+            size_t regionFrames;
+            size_t live;
+            size_t recovered;
+            size_t banks;
+            size_t heapSize;
+            size_t releasedBanks;
+            size_t roots;
+            size_t rootChanges;
+            size_t residentBytes;
+            uint64_t minorTimeNs;
+            uint64_t majorTimeNs;
+            uint64_t sweepTimeNs;
+            uint64_t maxMinorPauseNs;
+            uint64_t maxMajorPauseNs;
+            size_t minorPauses[HistogramBuckets];
+            size_t majorPauses[HistogramBuckets];
+        }; // GC::Stats
+
+        static Stats Statistics();
+
+        enum class EventKind {
+            MinorCollection,
+            FullCollection,
+            HeapGrown,
+            HeapShrunk,
+        }; // GC::EventKind
+
+        /** Reported to the listeners after every collection and every change of the heap size.
+
+            The allocated cells are counted since the previous event of the same kind. For minor collections, live is the number of cells promoted and recovered the number of nursery cells that were not. The pause is 0 for the heap size changes.
+         */
+        struct Event {
+            EventKind kind;
+            uint64_t pauseNs;
+            size_t allocated;
+            size_t live;
+            size_t recovered;
+            size_t heapSize;
+        }; // GC::Event
+
+        using Listener = std::function<void(Event const &)>;
+
+        /** Adds a listener to be called for every GC event and returns its id.
+
+            Listeners must not allocate any cells.
+         */
+        static size_t AddListener(Listener listener);
+
+        static void RemoveListener(size_t id);
+
         /** Runs the GC.
+
+            Performs a full collection, i.e. empties the nursery first and then collects the tenured space.
          */
         static void Run();
 
+        /** Sets the nursery size in cells, 0 disables the nursery.
+
+            Any cells in the current nursery are promoted first.
+         */
+        static void SetNurserySize(size_t cells);
+
+        /** Sets the heap policy.
+
+            Applies the nursery size immediately and grows the tenured space to the initial heap size if smaller. The bank size is ignored if banks have been created already.
+         */
+        static void Configure(HeapPolicy const & policy);
+
+        static HeapPolicy const & Policy() {
+            return policy_;
+        }
+
+        /** Returns true if the given cell lives in the nursery.
+         */
+        static bool IsYoung(Cell const * cell) {
+            return cell >= nursery_ && cell < nurseryEnd_ && ! IsImmediate(cell);
+        }
+
+        /** Creates an environment frame of the given number of slots, all set to immediate 0, with the given parent.
+
+            Frames are the only cells with variable size. Their slots live outside of the GC heap in a malloc'd array, which the GC frees when the frame dies. The parent is taken by reference so that it is read only after the cell has been allocated.
+         */
+        static Cell * NewFrame(Cell * const & parent, size_t size);
+
+        /** Changes the number of slots of the frame, new slots are set to immediate 0.
+         */
+        static void ResizeFrame(Cell * frame, size_t size);
+
+        /** Creates a frame in the frame region, or in the heap if the region is full, as NewFrame does.
+
+            The frame region is a stack of frames which die when the call that created them returns, so that the interpreter pops them instead of leaving them to the GC. The frames in the region are not cells of the heap, they are never marked nor moved and their slots are scanned as roots, so only a frame which no heap cell points to once it is popped may be created in the region. The slots follow the cell, so no memory is allocated.
+         */
+        static Cell * NewRegionFrame(Cell * const & parent, size_t size) {
+            size_t words = RegionFrameWords(size);
+            if (static_cast<size_t>(regionEnd_ - regionTop_) < words)
+                return NewRegionFrameSlow(parent, size);
+            ++regionFrames_;
+            Cell * result = reinterpret_cast<Cell *>(regionTop_);
+            regionTop_ += words;
+            size_t * block = reinterpret_cast<size_t *>(result + 1);
+            block[0] = size;
+            result->kind = CellKind::Frame;
+            result->slots = reinterpret_cast<Cell **>(block + 1);
+            result->parent = parent;
+            return result;
+        }
+
+        /** Returns true if the given cell is a frame in the frame region.
+         */
+        static bool InRegion(Cell const * cell) {
+            uintptr_t const * x = reinterpret_cast<uintptr_t const *>(cell);
+            return x >= region_ && x < regionEnd_;
+        }
+
+        /** Returns the current top of the frame region.
+         */
+        static size_t RegionTop() {
+            return regionTop_ - region_;
+        }
+
+        /** Pops all frames above the given top of the frame region.
+         */
+        static void PopRegion(size_t top) {
+            assert(top <= RegionTop() && "Region can only be popped");
+            regionTop_ = region_ + top;
+        }
+
+        /** Pops the frame if it is the topmost frame of the region, used when the frame dies without its call returning, as in a tail call.
+         */
+        static void PopRegionFrame(Cell * frame) {
+            if (InRegion(frame) && reinterpret_cast<uintptr_t *>(frame) + RegionFrameWords(frame->frameSize()) == regionTop_)
+                regionTop_ = reinterpret_cast<uintptr_t *>(frame);
+        }
+
+        /** Write barrier to be called whenever a pointer to value is stored in the target cell.
+
+            Tenured cells pointing to the nursery are added to the remembered set so that the minor collection can find and update them.
+         */
+        static void WriteBarrier(Cell * target, Cell * value);
+
         class Cell {
-        private:
-            friend class GC;
-            
-            CellStatus status;
         public:
             
             CellKind kind;
@@ -59,8 +319,19 @@ namespace secd {
                     GC::Cell * body;
                     GC::Cell * environment;
                 };
+                struct {
+                    GC::Cell ** slots;
+                    GC::Cell * parent;
+                };
             };
 
+            /** Number of slots of a frame, which is stored in the word preceding the slots.
+             */
+            size_t frameSize() const {
+                assert(kind == CellKind::Frame && "Accessing size of non-frame cell");
+                return reinterpret_cast<size_t const *>(slots)[-1];
+            }
+
             Cell(CellKind kind, int64_t valueInt):
                 kind(kind),
                 valueInt(valueInt) {
@@ -71,7 +342,9 @@ namespace secd {
                 name(name) {
             }
 
-            Cell(CellKind kind, GC::Cell * car, GC::Cell * cdr):
+            /** The pointers are taken by reference so that they are read only after the cell has been allocated, which may move them.
+             */
+            Cell(CellKind kind, GC::Cell * const & car, GC::Cell * const & cdr):
                 kind(kind),
                 car(car),
                 cdr(cdr) {
@@ -84,78 +357,506 @@ namespace secd {
         };
 
 
+        /** Registers the given cell pointer as a GC root.
+
+            Roots live on a contiguous shadow stack. Values are mostly created and destroyed in LIFO order so adding a root is a push and removing it is usually a pop.
+         */
         static void AddRoot(Cell * & cell) {
-            roots_.insert(& cell);
+            if (numRoots_ == rootsCapacity_)
+                GrowRoots();
+            roots_[numRoots_++] = & cell;
             ++rootChanges_;
         }
 
-        static void RemoveRoot(Cell *& cell) {
-            assert(roots_.find(& cell) != roots_.end() && "Removing non-existing root");
-            roots_.erase(& cell);
+        /** Removes the given root.
+
+            If the root is not on the top of the shadow stack it is searched for from the top and replaced with a tombstone, which is discarded once it reaches the top.
+         */
+        static void RemoveRoot(Cell * & cell) {
+            assert(numRoots_ > 0 && "Removing non-existing root");
+            if (roots_[numRoots_ - 1] == & cell) {
+                --numRoots_;
+                while (numRoots_ > 0 && roots_[numRoots_ - 1] == nullptr)
+                    --numRoots_;
+            } else {
+                *FindRoot(cell) = nullptr;
+            }
             ++rootChanges_;
         }
-        
+
+        /** Range of cell pointers scanned as GC roots as a whole, such as the array backed stacks of the interpreter.
+
+            The range is given by references to its beginning and end so that its owner can grow and move it freely. Immediate integers may be stored in the range as well. Ranges form an intrusive list so that registering one never allocates.
+         */
+        class RootRange {
+        public:
+            RootRange(Cell ** const & begin, Cell ** const & end):
+                begin(begin),
+                end(end),
+                prev(nullptr),
+                next(nullptr) {
+            }
+
+            Cell ** const & begin;
+            Cell ** const & end;
+
+        private:
+            friend class GC;
+
+            RootRange * prev;
+            RootRange * next;
+        }; // GC::RootRange
+
+        static void AddRootRange(RootRange & range) {
+            range.prev = nullptr;
+            range.next = rootRanges_;
+            if (rootRanges_ != nullptr)
+                rootRanges_->prev = & range;
+            rootRanges_ = & range;
+        }
+
+        static void RemoveRootRange(RootRange & range) {
+            if (range.prev != nullptr)
+                range.prev->next = range.next;
+            else
+                rootRanges_ = range.next;
+            if (range.next != nullptr)
+                range.next->prev = range.prev;
+        }
+
+        /** Transfers the root slot of one cell pointer to another one, used when values are moved.
+         */
+        static void MoveRoot(Cell * & from, Cell * & to) {
+            if (roots_[numRoots_ - 1] == & from)
+                roots_[numRoots_ - 1] = & to;
+            else
+                *FindRoot(from) = & to;
+            ++rootChanges_;
+        }
+
     private:
 
         friend class Cell;
         
+        /** Bank of tenured cells.
+
+            Each bank occupies bankBytes_ aligned to its size so that the bank of any tenured cell can be found by masking the cell address. The bank header and its bitmaps are at the beginning of the block, followed by the cells. The i-th bit of each bitmap belongs to the i-th cell of the bank.
+         */
         class Bank {
         public:
 
-            /** Creates new bank and populates the free list with it.
+            /** Creates new bank with all cells free.
              */
-            Bank(Bank * next, Cell * & freeList);
+            static Bank * Create(Bank * next);
 
+            /** Returns the memory of the bank to the system.
+             */
+            static void Release(Bank * bank);
 
-            /** Pointer to the bank itself, which is just an array of the cells allocated when the bank is created.  
+            /** Returns the bank the given tenured cell belongs to.
              */
-            Cell * cells;
+            static Bank * Of(Cell const * cell) {
+                return reinterpret_cast<Bank *>(reinterpret_cast<uintptr_t>(cell) & ~(bankBytes_ - 1));
+            }
+
+            size_t indexOf(Cell const * cell) const {
+                return cell - cells;
+            }
 
             /** Pointer to the next bank.
              */
             Bank * next;
+
+            /** The cells of the bank, which follow the bitmaps.
+             */
+            Cell * cells;
+
+            /** Cells marked live by the current mark phase. In the copying mode, cells already copied to the new banks.
+             */
+            uint64_t * markBits;
+
+            /** Allocated cells. The bits past the last cell are always set so that they are never allocated.
+             */
+            uint64_t * allocBits;
+
+            /** Cells in the remembered set.
+             */
+            uint64_t * rememberedBits;
+
+            /** True if the bank has not been swept since the last mark phase.
+             */
+            bool unswept;
+
+            /** True for the banks cells are copied to during compaction.
+             */
+            bool toSpace;
         }; // GC::Bank
 
+        static bool TestBit(uint64_t const * bits, size_t i) {
+            return bits[i / 64] & (uint64_t{1} << (i % 64));
+        }
+
+        static void SetBit(uint64_t * bits, size_t i) {
+            bits[i / 64] |= uint64_t{1} << (i % 64);
+        }
+
+        static void ClearBit(uint64_t * bits, size_t i) {
+            bits[i / 64] &= ~(uint64_t{1} << (i % 64));
+        }
+
+        /** Returns the index of the lowest set bit, which must exist.
+         */
+        static unsigned FirstSet(uint64_t bits) {
+            assert(bits != 0 && "No bit set");
+#if defined(__GNUC__)
+            return __builtin_ctzll(bits);
+#else
+            unsigned result = 0;
+            while ((bits & 1) == 0) {
+                bits >>= 1;
+                ++result;
+            }
+            return result;
+#endif
+        }
+
         static void * AllocateCell() {
-            if (freeList_ == nullptr)
-                GC::Run();
-            freeList_->status = CellStatus::Used;
-            void * result = freeList_;
-            if (reinterpret_cast<char*>(freeList_->car) + 1 == nullptr)
-                ++freeList_;
-            else
-                freeList_ = freeList_->car;
             ++allocations_;
-            return result;
+            if (nurseryTop_ != nurseryEnd_)
+                return nurseryTop_++;
+            if (nurserySize_ == 0 && freeBits_ != 0)
+                return AllocateTenured();
+            return AllocateSlow();
+        }
+
+        /** Allocation when the nursery is full, or when there are no free cells in the current bitmap word if the nursery is disabled.
+         */
+        static Cell * AllocateSlow();
+
+        /** Applies the policy from the environment unless configured already.
+         */
+        static void Initialize();
+
+        /** Grows the tenured space by at least the given number of cells, up to the maximum heap size.
+
+            Returns false if the heap could not grow at all.
+         */
+        static bool Grow(size_t cells);
+
+        /** Returns the lowest free cell of the current bitmap word and marks it allocated, adding new bank if there are no free cells left.
+         */
+        static Cell * AllocateTenured() {
+            if (freeBits_ == 0 && ! NextFreeCells()) {
+                AddBank();
+                NextFreeCells();
+            }
+            unsigned i = FirstSet(freeBits_);
+            freeBits_ &= freeBits_ - 1;
+            allocBank_->allocBits[allocWord_] |= uint64_t{1} << i;
+            --freeCells_;
+            return allocBank_->cells + allocWord_ * 64 + i;
         }
 
+        /** Finds the next bitmap word with free cells, sweeping the banks on the way if necessary.
+
+            Returns false if all banks are exhausted.
+         */
+        static bool NextFreeCells();
+
+        /** Adds a bank after the current allocation bank, throws std::bad_alloc if the maximum heap size would be exceeded.
+         */
+        static void AddBank();
+
+        /** Determines the bank layout from the policy's bank size.
+         */
+        static void SetupBanks();
+
+        /** Returns memory for a bank, aligned to its size, mapping new chunk if there are no free blocks.
+         */
+        static void * AllocateBlock();
+
+        /** Returns the memory of a released bank to the OS.
+         */
+        static void ReleaseBlock(void * block);
+
+        /** Returns empty banks to the OS if the heap has been larger than necessary for long enough. Must be called right after the mark phase.
+         */
+        static void ReleaseEmptyBanks();
+
+        /** Returns the resident set size of the process in bytes, 0 if unknown.
+         */
+        static size_t ResidentBytes();
+
+        /** Returns the peak resident set size of the process in bytes, 0 if unknown.
+         */
+        static size_t PeakResidentBytes();
+
+        /** Number of words a frame with the given number of slots takes in the frame region.
+         */
+        static size_t RegionFrameWords(size_t size) {
+            return sizeof(Cell) / sizeof(uintptr_t) + 1 + size;
+        }
+
+        /** Creates the frame region if the policy asks for one, or creates the frame in the heap if the region is full.
+         */
+        static Cell * NewRegionFrameSlow(Cell * const & parent, size_t size);
+
+        /** Replaces the frame region by one of the given size in cells, the region must be empty.
+         */
+        static void SetRegionSize(size_t cells);
+
+        /** Creates the nursery if it does not exist yet.
+         */
+        static void CreateNursery();
+
+        /** Minor collection.
+
+            Evacuates the nursery and if the tenured space is low on free cells afterwards, full collection of the tenured space follows.
+         */
+        static void CollectNursery();
+
+        /** Promotes all live nursery cells to the tenured space and resets the nursery.
+         */
+        static void EvacuateNursery();
+
+        /** Full collection of the tenured space using the configured mode. The nursery must be empty.
+
+            Collections requested by Run() do not say anything about the GC overhead and so do not grow the heap because of it.
+         */
+        static void CollectTenured(bool requested = false);
+
+        /** Copies all live tenured cells into new banks and releases the old ones.
+         */
+        static void Compact();
+
+        /** Returns the new address of the cell, copying it and the spine of the list it starts if not copied yet.
+         */
+        static Cell * Copy(Cell * cell);
+
+        /** Copies single cell into the new banks and leaves forwarding pointer in the old one, which is marked.
+         */
+        static Cell * CopyCell(Cell * cell);
+
+        /** Moves the cell to the tenured space if it is in the nursery and returns its new address.
+         */
+        static Cell * Promote(Cell * cell);
+
         /** Mark phase of the collector where all cells reachable from the roots are marked as live.
          */
         static void Mark();
 
-        /** Sweep phase of the collector where each bank is visited and any unmarked cells are returned to the free list.
+        /** Thread of the parallel mark phase.
          */
-        static void Sweep();
+        class Marker;
 
-        /** Number of allocations since last GC cycle.
+        /** Marks the live cells using the given number of threads.
+
+            Each thread starts from its share of the roots and steals work from the others once it runs out of its own.
+         */
+        static void MarkParallel(size_t threads);
+
+        /** Sweeps the bank so that its marked cells become the allocated ones, and clears the marks.
+         */
+        static void Sweep(Bank * bank);
+
+        /** Sweeps all the remaining banks, which must be done before the next mark phase.
+         */
+        static void FinishSweep();
+
+        /** Records the pause of a minor or full collection for the pause statistics.
+         */
+        static void RecordPause(EventKind kind, uint64_t ns);
+
+        /** Logs the event if enabled and passes it to the listeners.
+         */
+        static void Report(Event const & event);
+
+        /** Size of the chunks mapped from the OS, banks larger than that are mapped one by one.
+         */
+        static size_t constexpr ChunkBytes = 2 * 1024 * 1024;
+
+        /** Size of a bank in bytes, which is a power of two, the number of cells in it and the number of words of each of its bitmaps.
+         */
+        static size_t bankBytes_;
+        static size_t bankCells_;
+        static size_t bitmapWords_;
+
+        /** Bank and bitmap word cells are allocated from, and the free cells of the word not yet allocated.
+
+            If the bank is nullptr, the allocation continues from the first bank.
+         */
+        static Bank * allocBank_;
+        static size_t allocWord_;
+        static uint64_t freeBits_;
+
+        /** Banks cells are copied to during compaction in the order of their creation, and the bump allocation pointer in the last one.
+         */
+        static std::vector<Bank *> toSpace_;
+        static Cell * copyTop_;
+        static Cell * copyEnd_;
+
+        /** Number of allocations since the program start, and at the last minor and full collection.
          */
         static size_t allocations_;
+        static size_t minorAllocations_;
+        static size_t majorAllocations_;
+
+        /** Number of cells recovered by minor and full collections since the program start.
+         */
+        static size_t recovered_;
+
+        /** Number of GC cycles since the program start.
+         */
+        static size_t cycles_;
+
+        /** Number of minor collections since the program start.
+         */
+        static size_t minorCycles_;
+
+        /** Number of cells promoted from the nursery since the program start.
+         */
+        static size_t promoted_;
+
+        /** Total time spent in minor and full collections, and the longest pause of each.
+         */
+        static uint64_t minorTimeNs_;
+        static uint64_t majorTimeNs_;
+        static uint64_t maxMinorPauseNs_;
+        static uint64_t maxMajorPauseNs_;
+
+        /** Total time spent in lazy sweeping and the longest sweep of a single bank.
+         */
+        static uint64_t sweepTimeNs_;
+        static uint64_t maxSweepNs_;
+
+        /** Ring buffer of the recent pauses and the number of pauses recorded.
+         */
+        static uint64_t pauses_[PauseHistory];
+        static size_t numPauses_;
+
+        static size_t minorHistogram_[HistogramBuckets];
+        static size_t majorHistogram_[HistogramBuckets];
+
+        static std::vector<std::pair<size_t, Listener>> listeners_;
+        static size_t nextListenerId_;
+
+        /** Number of free cells in the tenured space.
+         */
+        static size_t freeCells_;
+
+        /** The nursery, its size in cells, and the bump allocation pointer.
+         */
+        static Cell * nursery_;
+        static Cell * nurseryTop_;
+        static Cell * nurseryEnd_;
+        static size_t nurserySize_;
+
+        /** The frame region, its top and the number of frames created in it since the program start.
+         */
+        static uintptr_t * region_;
+        static uintptr_t * regionTop_;
+        static uintptr_t * regionEnd_;
+        static size_t regionFrames_;
+
+        /** Nursery cells already promoted, whose car is the forwarding pointer.
+         */
+        static uint64_t * nurseryForwarded_;
+
+        /** Tenured cells which may point to the nursery.
+         */
+        static std::vector<Cell *> remembered_;
+
+        /** Cells promoted during the current minor collection whose contents have not been promoted yet.
+         */
+        static std::vector<Cell *> promotedQueue_;
+
+        /** Frames in the nursery and in the tenured space, so that the slots of the dead ones can be freed.
+         */
+        static std::vector<Cell *> youngFrames_;
+        static std::vector<Cell *> frames_;
 
         static size_t numBanks_;
 
+        /** Number of banks returned to the OS since the program start.
+         */
+        static size_t releasedBanks_;
+
+        /** Number of consecutive full collections after which the heap had more empty banks than needed.
+         */
+        static size_t surplusCycles_;
+
+        /** Blocks of the mapped chunks not used by any bank.
+         */
+        static std::vector<void *> freeBlocks_;
+
+        /** Number of cells in the tenured space.
+         */
+        static size_t heapSize_;
+
+        static HeapPolicy policy_;
+
+        static bool initialized_;
+
+        /** Total GC time and time at the end of the previous full collection, used to determine the GC overhead.
+         */
+        static uint64_t lastGcTimeNs_;
+        static uint64_t lastMajorEndNs_;
+
         static size_t liveObjects_;
 
         /** Top bank.
          */
         static Bank * bank_;
 
-        /** The beginning of the free list of the current bank.
+        /** Enlarges the shadow stack of roots.
          */
-        static Cell * freeList_;
+        static void GrowRoots();
 
-        static std::unordered_set<Cell **> roots_;
+        /** Calls the given function for each root slot, i.e. for the shadow stack, all root ranges and the slots of the frames in the frame region.
+         */
+        template<typename F>
+        static void ForEachRoot(F f);
+
+        /** Calls the given function for each pointer slot of the given cell.
+         */
+        template<typename F>
+        static void ForEachChild(Cell * cell, F f);
+
+        /** Frees the slots of the frames that did not survive the minor collection and moves the promoted ones to the tenured frames. Must be called before the forwarding bits are cleared.
+         */
+        static void SweepYoungFrames();
+
+        /** Frees the slots of tenured frames which are not marked, or in the copying mode not copied, replacing the copied frames with their copies.
+         */
+        static void SweepFrames(bool copied);
+
+        static void FreeSlots(Cell * frame) {
+            free(reinterpret_cast<size_t *>(frame->slots) - 1);
+        }
+
+        static Cell *** FindRoot(Cell * & cell) {
+            for (Cell *** i = roots_ + numRoots_; i != roots_; ) {
+                --i;
+                if (*i == & cell)
+                    return i;
+            }
+            assert(false && "Removing non-existing root");
+            return nullptr;
+        }
+
+        /** Shadow stack of the roots.
+
+            Plain pointers and counters so that the stack is usable from static initializers of other translation units regardless of their initialization order.
+         */
+        static Cell *** roots_;
+
+        static size_t numRoots_;
+
+        static size_t rootsCapacity_;
 
         static size_t rootChanges_;
+
+        static RootRange * rootRanges_;
         
     };
     
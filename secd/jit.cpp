@@ -0,0 +1,973 @@
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <set>
+
+#include "jit.h"
+#include "secd.h"
+
+#if defined(SECD_JIT)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace secd {
+
+#if defined(SECD_JIT)
+
+    namespace {
+
+        enum Register : uint8_t {
+            RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+            R8, R9, R10, R11, R12, R13, R14, R15,
+        };
+
+        enum Condition : uint8_t {
+            O = 0x0,
+            NO = 0x1,
+            E = 0x4,
+            NE = 0x5,
+            L = 0xc,
+            GE = 0xd,
+            LE = 0xe,
+            G = 0xf,
+        };
+
+        /** Opcodes of the arithmetic instructions with a register operand, and their extensions of the opcode with an immediate operand.
+         */
+        enum class Alu : uint8_t {
+            Add = 0x01,
+            Or = 0x09,
+            And = 0x21,
+            Sub = 0x29,
+            Xor = 0x31,
+            Cmp = 0x39,
+        };
+
+        uint8_t extension(Alu op) {
+            switch (op) {
+            case Alu::Add:
+                return 0;
+            case Alu::Or:
+                return 1;
+            case Alu::And:
+                return 4;
+            case Alu::Sub:
+                return 5;
+            case Alu::Xor:
+                return 6;
+            default:
+                return 7;
+            }
+        }
+
+        /** Emits the few x86-64 instructions the templates need directly to the writable mapping of the native code.
+
+            All memory operands are a base register with a 32bit displacement and all jumps have 32bit offsets, so that the encoding does not depend on the values. If the code does not fit in the memory, the assembler stops writing and only remembers that it overflowed.
+         */
+        class Assembler {
+        public:
+
+            Assembler(uint8_t * code, size_t size, size_t capacity):
+                code_(code),
+                size_(size),
+                capacity_(capacity) {
+            }
+
+            size_t size() const {
+                return size_;
+            }
+
+            bool overflow() const {
+                return size_ > capacity_;
+            }
+
+            /** mov dst, [base + disp] */
+            void load(Register dst, Register base, int32_t disp) {
+                rex(true, dst, base);
+                byte(0x8b);
+                memory(dst, base, disp);
+            }
+
+            /** mov [base + disp], src */
+            void store(Register base, int32_t disp, Register src) {
+                rex(true, src, base);
+                byte(0x89);
+                memory(src, base, disp);
+            }
+
+            /** mov dst, src */
+            void mov(Register dst, Register src) {
+                rex(true, src, dst);
+                byte(0x89);
+                direct(src, dst);
+            }
+
+            /** mov dst, imm64 */
+            void mov(Register dst, uint64_t value) {
+                rex(true, RAX, dst);
+                byte(0xb8 + (dst & 7));
+                qword(value);
+            }
+
+            /** mov dst32, imm32, which zero extends */
+            void mov32(Register dst, uint32_t value) {
+                rex(false, RAX, dst);
+                byte(0xb8 + (dst & 7));
+                dword(value);
+            }
+
+            /** op dst, src */
+            void alu(Alu op, Register dst, Register src) {
+                rex(true, src, dst);
+                byte(static_cast<uint8_t>(op));
+                direct(src, dst);
+            }
+
+            /** op dst, imm32 */
+            void alu(Alu op, Register dst, int32_t value) {
+                rex(true, RAX, dst);
+                byte(0x81);
+                direct(extension(op), dst);
+                dword(value);
+            }
+
+            /** cmp dword [base + disp], imm32 */
+            void compare32(Register base, int32_t disp, int32_t value) {
+                rex(false, RAX, base);
+                byte(0x81);
+                memory(7, base, disp);
+                dword(value);
+            }
+
+            /** test reg, imm32 */
+            void test(Register reg, int32_t value) {
+                rex(true, RAX, reg);
+                byte(0xf7);
+                direct(0, reg);
+                dword(value);
+            }
+
+            /** test al, al */
+            void testResult() {
+                byte(0x84);
+                byte(0xc0);
+            }
+
+            /** imul dst, src */
+            void imul(Register dst, Register src) {
+                rex(true, dst, src);
+                byte(0x0f);
+                byte(0xaf);
+                direct(dst, src);
+            }
+
+            /** sar reg, 1 */
+            void sar(Register reg) {
+                rex(true, RAX, reg);
+                byte(0xd1);
+                direct(7, reg);
+            }
+
+            /** idiv reg, preceded by cqo */
+            void idiv(Register reg) {
+                byte(0x48);
+                byte(0x99);
+                rex(true, RAX, reg);
+                byte(0xf7);
+                direct(7, reg);
+            }
+
+            /** Sets rax to the immediate integer 1 if the condition holds and to the immediate integer 0 otherwise.
+             */
+            void setImmediate(Condition c) {
+                // setcc al, movzx eax, al
+                byte(0x0f);
+                byte(0x90 + c);
+                byte(0xc0);
+                byte(0x0f);
+                byte(0xb6);
+                byte(0xc0);
+                tag();
+            }
+
+            /** Makes an immediate integer of rax, i.e. lea rax, [rax * 2 + 1].
+             */
+            void tag() {
+                byte(0x48);
+                byte(0x8d);
+                byte(0x04);
+                byte(0x45);
+                dword(1);
+            }
+
+            void push(Register reg) {
+                if (reg & 8)
+                    byte(0x41);
+                byte(0x50 + (reg & 7));
+            }
+
+            void pop(Register reg) {
+                if (reg & 8)
+                    byte(0x41);
+                byte(0x58 + (reg & 7));
+            }
+
+            void call(Register reg) {
+                rex(false, RAX, reg);
+                byte(0xff);
+                direct(2, reg);
+            }
+
+            void jmp(Register reg) {
+                rex(false, RAX, reg);
+                byte(0xff);
+                direct(4, reg);
+            }
+
+            void ret() {
+                byte(0xc3);
+            }
+
+            /** Emits a jump and returns the position of its offset, which is to be patched.
+             */
+            size_t jmp() {
+                byte(0xe9);
+                dword(0);
+                return size_ - 4;
+            }
+
+            size_t jcc(Condition c) {
+                byte(0x0f);
+                byte(0x80 + c);
+                dword(0);
+                return size_ - 4;
+            }
+
+            /** Sets the target of the jump whose offset is at the given position.
+             */
+            void patch(size_t at, size_t target) {
+                if (at + 4 > capacity_)
+                    return;
+                int32_t offset = static_cast<int32_t>(target - (at + 4));
+                memcpy(code_ + at, & offset, 4);
+            }
+
+            /** Patches the jump to the current position.
+             */
+            void bind(size_t at) {
+                patch(at, size_);
+            }
+
+        private:
+
+            void rex(bool wide, int reg, int base) {
+                uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+                if (prefix != 0x40)
+                    byte(prefix);
+            }
+
+            void memory(int reg, int base, int32_t disp) {
+                byte(0x80 | ((reg & 7) << 3) | (base & 7));
+                // rsp and r12 as the base need the SIB byte
+                if ((base & 7) == RSP)
+                    byte(0x24);
+                dword(static_cast<uint32_t>(disp));
+            }
+
+            void direct(int reg, int rm) {
+                byte(0xc0 | ((reg & 7) << 3) | (rm & 7));
+            }
+
+            void byte(uint8_t value) {
+                if (size_ < capacity_)
+                    code_[size_] = value;
+                ++size_;
+            }
+
+            void dword(uint32_t value) {
+                for (size_t i = 0; i < 4; ++i)
+                    byte(static_cast<uint8_t>(value >> (i * 8)));
+            }
+
+            void qword(uint64_t value) {
+                for (size_t i = 0; i < 8; ++i)
+                    byte(static_cast<uint8_t>(value >> (i * 8)));
+            }
+
+            uint8_t * code_;
+            size_t size_;
+            size_t capacity_;
+        }; // Assembler
+
+        /** Offsets of the fields of the cells.
+         */
+        int32_t constexpr Kind = offsetof(GC::Cell, kind);
+        int32_t constexpr Car = offsetof(GC::Cell, car);
+        int32_t constexpr Cdr = offsetof(GC::Cell, cdr);
+        int32_t constexpr Slots = offsetof(GC::Cell, slots);
+        int32_t constexpr Parent = offsetof(GC::Cell, parent);
+
+        /** Returns the offset of the field from the interpreter, which the native code addresses relative to rbx.
+         */
+        template<typename T>
+        int32_t field(Interpreter const & interpreter, T const & member) {
+            return static_cast<int32_t>(reinterpret_cast<char const *>(& member) - reinterpret_cast<char const *>(& interpreter));
+        }
+
+        template<typename T>
+        uint64_t address(T * function) {
+            return reinterpret_cast<uint64_t>(function);
+        }
+
+    } // anonymous namespace
+
+    Jit::Jit(Interpreter & interpreter):
+        interpreter_(interpreter),
+        threshold_(DefaultThreshold) {
+        fromEnvironment("SECD_JIT_THRESHOLD", threshold_);
+    }
+
+    Jit::~Jit() {
+        if (code_ != nullptr) {
+            munmap(code_, CodeSize);
+            munmap(writable_, CodeSize);
+        }
+    }
+
+    void Jit::setThreshold(size_t value) {
+        threshold_ = value;
+    }
+
+    size_t Jit::run(void * native, size_t & count) {
+        executed_ = 0;
+        reinterpret_cast<void (*)(Interpreter *, void *)>(code_)(& interpreter_, native);
+        count += executed_;
+        if (error_) {
+            std::exception_ptr error = error_;
+            error_ = nullptr;
+            std::rethrow_exception(error);
+        }
+        return exit_;
+    }
+
+    void Jit::initialize() {
+        // no functions are compiled unless both mappings succeed, the file only takes the memory of the pages written
+        full_ = true;
+        int fd = memfd_create("secd-jit", MFD_CLOEXEC);
+        if (fd < 0)
+            return;
+        void * writable = MAP_FAILED;
+        void * code = MAP_FAILED;
+        if (ftruncate(fd, CodeSize) == 0) {
+            writable = mmap(nullptr, CodeSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            code = mmap(nullptr, CodeSize, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (writable == MAP_FAILED || code == MAP_FAILED) {
+            if (writable != MAP_FAILED)
+                munmap(writable, CodeSize);
+            if (code != MAP_FAILED)
+                munmap(code, CodeSize);
+            return;
+        }
+        full_ = false;
+        code_ = static_cast<uint8_t *>(code);
+        writable_ = static_cast<uint8_t *>(writable);
+        Assembler a(writable_, 0, CodeSize);
+        // entry called as void(Interpreter *, void * native), saves the callee saved registers and aligns the stack for the runtime calls
+        a.push(RBX);
+        a.push(RBP);
+        a.push(R12);
+        a.push(R13);
+        a.push(R14);
+        a.push(R15);
+        a.alu(Alu::Sub, RSP, 8);
+        a.mov(RBX, RDI);
+        a.alu(Alu::Xor, R12, R12);
+        a.jmp(RSI);
+        // exit, the stack top has been stored and the offset to continue at set by then
+        exitOffset_ = a.size();
+        a.alu(Alu::Add, RSP, 8);
+        a.store(RBX, field(interpreter_, executed_), R12);
+        a.pop(R15);
+        a.pop(R14);
+        a.pop(R13);
+        a.pop(R12);
+        a.pop(RBP);
+        a.pop(RBX);
+        a.ret();
+        size_ = a.size();
+    }
+
+    void * Jit::compile(size_t entry) {
+        if (code_ == nullptr && ! full_)
+            initialize();
+        if (full_)
+            return nullptr;
+        Bytecode const & bytecode = interpreter_.bytecode_;
+        uint32_t const * code = bytecode.code();
+        // find the instructions of the function, i.e. those reachable from the entry, and the return addresses of its calls
+        std::map<size_t, size_t> labels;
+        std::set<size_t> entries{entry};
+        std::vector<size_t> work{entry};
+        while (! work.empty()) {
+            size_t pc = work.back();
+            work.pop_back();
+            if (! labels.insert(std::make_pair(pc, 0)).second)
+                continue;
+            uint32_t opcode = code[pc];
+            size_t next = pc + 1 + Bytecode::OperandCount(opcode);
+            switch (opcode) {
+            case Instruction::SEL:
+            case Instruction::BLT:
+            case Instruction::BGT:
+            case Instruction::BEQ:
+            case Instruction::BNIL:
+                work.push_back(pc + code[pc + 1]);
+                work.push_back(next);
+                break;
+            case Instruction::LDC_LD0_BLT:
+            case Instruction::LDC_LD0_BGT:
+            case Instruction::LDC_LD0_BEQ:
+                work.push_back(pc + code[pc + 3]);
+                work.push_back(next);
+                break;
+            case Instruction::JOIN:
+                work.push_back(pc + code[pc + 1]);
+                break;
+            case Instruction::AP:
+            case Instruction::APN:
+            case Instruction::RAPN:
+            case Instruction::LDG_APN:
+                entries.insert(next);
+                work.push_back(next);
+                break;
+            case Instruction::RTN:
+            case Instruction::TAP:
+            case Instruction::TAPN:
+            case Instruction::TRAPN:
+            case Instruction::LDG_TAPN:
+            case Instruction::STOP:
+            case Instruction::DEFUN:
+            case Instruction::PRINT:
+            case Instruction::READ:
+                break;
+            default:
+                work.push_back(next);
+            }
+        }
+
+        int32_t const top = field(interpreter_, interpreter_.s_.top_);
+        int32_t const end = field(interpreter_, interpreter_.s_.end_);
+        int32_t const environment = field(interpreter_, interpreter_.e_.v_.data_);
+        int32_t const globals = field(interpreter_, interpreter_.e_.globals_.data_);
+        int32_t const exitPc = field(interpreter_, exit_);
+        int32_t const constants = field(interpreter_, interpreter_.bytecode_.constants_.begin_);
+        // every instruction pushes one value at most and there are no jumps back, so that the stack is only reserved when the code is entered
+        size_t reserve = labels.size();
+
+        Assembler a(writable_, size_, CodeSize);
+        // jumps to the instructions, to the bailouts and to the exit of the native code, which are patched once the whole function is emitted
+        std::vector<std::pair<size_t, size_t>> jumps;
+        std::vector<std::pair<size_t, size_t>> bailouts;
+        std::vector<std::pair<size_t, size_t>> natives;
+        std::vector<size_t> exits;
+        size_t pc;
+        size_t next;
+
+        auto slot = [](size_t index) {
+            return static_cast<int32_t>(index * sizeof(GC::Cell *));
+        };
+        auto loadValue = [& a](Register dst, Value const & value) {
+            if (ValueRef(value).isImmediate()) {
+                a.mov(dst, reinterpret_cast<uint64_t>(value.data_));
+            } else {
+                // the value is rooted, but the cell may be moved by the GC
+                a.mov(dst, reinterpret_cast<uint64_t>(& value.data_));
+                a.load(dst, dst, 0);
+            }
+        };
+        auto loadConstant = [& a, & bytecode, & slot, constants](Register dst, size_t index) {
+            ValueRef constant = bytecode.constant(index);
+            if (constant.isImmediate()) {
+                a.mov(dst, reinterpret_cast<uint64_t>(GC::MakeImmediate(constant.valueInt())));
+            } else {
+                // the pool is reallocated as more constants are added
+                a.load(dst, RBX, constants);
+                a.load(dst, dst, slot(index));
+            }
+        };
+        auto push = [& a](Register reg) {
+            a.store(R13, 0, reg);
+            a.alu(Alu::Add, R13, 8);
+        };
+        auto jump = [& a, & jumps](size_t target) {
+            jumps.push_back(std::make_pair(a.jmp(), target));
+        };
+        auto branch = [& a, & jumps](Condition c, size_t target) {
+            jumps.push_back(std::make_pair(a.jcc(c), target));
+        };
+        auto bailout = [& a, & bailouts, & pc](Condition c) {
+            bailouts.push_back(std::make_pair(a.jcc(c), pc));
+        };
+        // moves the frame at the given depth of the environment to rax
+        auto frame = [& a](size_t depth) {
+            a.mov(RAX, R14);
+            while (depth-- > 0)
+                a.load(RAX, RAX, Parent);
+        };
+        // rax and rcx are the top and second values of the stack, jumps to the bailout unless both are immediate integers
+        auto immediateOperands = [& a, & bailout]() {
+            a.load(RAX, R13, -8);
+            a.load(RCX, R13, -16);
+            a.mov(RDX, RAX);
+            a.alu(Alu::And, RDX, RCX);
+            a.test(RDX, GC::ImmediateTag);
+            bailout(E);
+        };
+        // the local variable to rax and the constant to rcx, jumps to the bailout unless both are immediate integers, returns false if the constant is not one
+        auto localAndConstant = [& a, & bailout, & bytecode, & code, & pc, & slot, & loadConstant]() {
+            if (! bytecode.constant(code[pc + 1]).isImmediate())
+                return false;
+            a.load(RAX, R15, slot(code[pc + 2]));
+            a.test(RAX, GC::ImmediateTag);
+            bailout(E);
+            loadConstant(RCX, code[pc + 1]);
+            return true;
+        };
+        // replaces the two values on the stack by rax
+        auto replace = [& a]() {
+            a.alu(Alu::Sub, R13, 8);
+            a.store(R13, -8, RAX);
+        };
+        auto reload = [& a, top, environment]() {
+            a.load(R13, RBX, top);
+            a.load(R14, RBX, environment);
+            a.load(R15, R14, Slots);
+        };
+        auto runtimeCall = [& a, top](uint64_t function) {
+            a.store(RBX, top, R13);
+            a.mov(RDI, RBX);
+            a.mov(RAX, function);
+            a.call(RAX);
+        };
+        // runtime call which continues with the next instruction and returns false on error
+        auto runtimeCallNext = [& a, & exits, & runtimeCall, & reload](uint64_t function) {
+            runtimeCall(function);
+            a.testResult();
+            exits.push_back(a.jcc(E));
+            reload();
+        };
+        // runtime call which continues with the native code it returns
+        auto runtimeCallJump = [& a, & runtimeCall](uint64_t function) {
+            runtimeCall(function);
+            a.jmp(RAX);
+        };
+        auto exitToInterpreter = [& a, & exits, & pc, top, exitPc]() {
+            a.store(RBX, top, R13);
+            a.mov(RAX, static_cast<uint64_t>(pc));
+            a.store(RBX, exitPc, RAX);
+            exits.push_back(a.jmp());
+        };
+        // exits from an instruction which has been counted already
+        auto bailoutNow = [& a, & exitToInterpreter]() {
+            a.alu(Alu::Sub, R12, 1);
+            exitToInterpreter();
+        };
+
+        for (auto i = labels.begin(); i != labels.end(); ++i) {
+            pc = i->first;
+            uint32_t opcode = code[pc];
+            next = pc + 1 + Bytecode::OperandCount(opcode);
+            // the entry and the return addresses load the registers and make sure the stack will not grow
+            if (entries.count(pc) != 0) {
+                natives.push_back(std::make_pair(pc, a.size()));
+                a.load(R13, RBX, top);
+                a.load(RAX, RBX, end);
+                a.alu(Alu::Sub, RAX, R13);
+                a.alu(Alu::Cmp, RAX, static_cast<int32_t>(reserve * sizeof(GC::Cell *)));
+                size_t reserved = a.jcc(GE);
+                a.mov(RDI, RBX);
+                a.mov32(RSI, static_cast<uint32_t>(reserve));
+                a.mov(RAX, address(Interpreter::NativeReserve));
+                a.call(RAX);
+                a.testResult();
+                exits.push_back(a.jcc(E));
+                a.load(R13, RBX, top);
+                a.bind(reserved);
+                a.load(R14, RBX, environment);
+                a.load(R15, R14, Slots);
+            }
+            i->second = a.size();
+            // counts the instruction, bailouts uncount it as the interpreter executes it again
+            if (opcode != Instruction::DEFUN && opcode != Instruction::PRINT && opcode != Instruction::READ && opcode != Instruction::STOP)
+                a.alu(Alu::Add, R12, 1);
+            switch (opcode) {
+            case Instruction::NIL:
+                loadValue(RAX, Nil);
+                push(RAX);
+                break;
+            case Instruction::LDC:
+                loadConstant(RAX, code[pc + 1]);
+                push(RAX);
+                break;
+            case Instruction::LD:
+                frame(code[pc + 1]);
+                a.load(RAX, RAX, Slots);
+                a.load(RAX, RAX, slot(code[pc + 2]));
+                push(RAX);
+                break;
+            case Instruction::LD0:
+                a.load(RAX, R15, slot(code[pc + 1]));
+                push(RAX);
+                break;
+            case Instruction::LD1:
+                frame(1);
+                a.load(RAX, RAX, Slots);
+                a.load(RAX, RAX, slot(code[pc + 1]));
+                push(RAX);
+                break;
+            case Instruction::LDG:
+                a.load(RAX, RBX, globals);
+                a.load(RAX, RAX, Slots);
+                a.load(RAX, RAX, slot(code[pc + 1]));
+                push(RAX);
+                break;
+            case Instruction::LDE:
+                frame(code[pc + 1]);
+                push(RAX);
+                break;
+            case Instruction::LDB:
+                frame(code[pc + 1]);
+                a.load(RAX, RAX, Slots);
+                a.load(RAX, RAX, slot(code[pc + 2]));
+                a.load(RAX, RAX, Slots);
+                a.load(RAX, RAX, slot(code[pc + 3]));
+                push(RAX);
+                break;
+            // only nil and 0 are false
+            case Instruction::SEL:
+                a.alu(Alu::Sub, R13, 8);
+                a.load(RAX, R13, 0);
+                loadValue(RCX, Nil);
+                a.alu(Alu::Cmp, RAX, RCX);
+                branch(E, pc + code[pc + 1]);
+                a.alu(Alu::Cmp, RAX, static_cast<int32_t>(reinterpret_cast<uintptr_t>(GC::MakeImmediate(0))));
+                branch(E, pc + code[pc + 1]);
+                break;
+            // tagging preserves the order of the integers
+            case Instruction::BLT:
+            case Instruction::BGT:
+                immediateOperands();
+                a.alu(Alu::Sub, R13, 16);
+                a.alu(Alu::Cmp, RAX, RCX);
+                branch(opcode == Instruction::BLT ? GE : LE, pc + code[pc + 1]);
+                break;
+            // eq of distinct cells is false, unless both are boxed integers
+            case Instruction::BEQ:
+            case Instruction::EQ:
+            case Instruction::EQ_II:
+            case Instruction::EQ_SYM: {
+                a.load(RAX, R13, -8);
+                a.load(RCX, R13, -16);
+                a.alu(Alu::Cmp, RAX, RCX);
+                size_t equal = a.jcc(E);
+                a.mov(RDX, RAX);
+                a.alu(Alu::Or, RDX, RCX);
+                a.test(RDX, GC::ImmediateTag);
+                size_t immediate = a.jcc(NE);
+                a.compare32(RAX, Kind, static_cast<int32_t>(GC::CellKind::Integer));
+                size_t notInteger = a.jcc(NE);
+                a.compare32(RCX, Kind, static_cast<int32_t>(GC::CellKind::Integer));
+                bailout(E);
+                a.bind(notInteger);
+                a.bind(immediate);
+                if (opcode == Instruction::BEQ) {
+                    a.alu(Alu::Sub, R13, 16);
+                    jump(pc + code[pc + 1]);
+                    a.bind(equal);
+                    a.alu(Alu::Sub, R13, 16);
+                } else {
+                    a.mov(RAX, reinterpret_cast<uint64_t>(GC::MakeImmediate(0)));
+                    size_t done = a.jmp();
+                    a.bind(equal);
+                    a.mov(RAX, reinterpret_cast<uint64_t>(GC::MakeImmediate(1)));
+                    a.bind(done);
+                    replace();
+                }
+                break;
+            }
+            case Instruction::BNIL:
+                a.alu(Alu::Sub, R13, 8);
+                a.load(RAX, R13, 0);
+                loadValue(RCX, Nil);
+                a.alu(Alu::Cmp, RAX, RCX);
+                branch(NE, pc + code[pc + 1]);
+                break;
+            case Instruction::JOIN:
+                jump(pc + code[pc + 1]);
+                break;
+            case Instruction::LDF:
+                a.mov32(RSI, code[pc + 1]);
+                a.mov32(RDX, code[pc + 2]);
+                runtimeCallNext(address(Interpreter::NativeClosure));
+                break;
+            case Instruction::AP:
+            case Instruction::TAP:
+                a.mov32(RSI, opcode == Instruction::AP ? static_cast<uint32_t>(next) : 0);
+                runtimeCallJump(address(Interpreter::NativeApply));
+                break;
+            case Instruction::APN:
+            case Instruction::TAPN:
+                a.mov32(RSI, code[pc + 1]);
+                a.mov32(RDX, opcode == Instruction::APN ? static_cast<uint32_t>(next) : 0);
+                runtimeCallJump(address(Interpreter::NativeCall));
+                break;
+            case Instruction::RAPN:
+            case Instruction::TRAPN:
+                a.mov32(RSI, code[pc + 1]);
+                a.mov32(RDX, opcode == Instruction::RAPN ? static_cast<uint32_t>(next) : 0);
+                runtimeCallJump(address(Interpreter::NativeCallRecursive));
+                break;
+            case Instruction::LDG_APN:
+            case Instruction::LDG_TAPN:
+                a.mov32(RSI, code[pc + 1]);
+                a.mov32(RDX, code[pc + 2]);
+                a.mov32(RCX, opcode == Instruction::LDG_APN ? static_cast<uint32_t>(next) : 0);
+                runtimeCallJump(address(Interpreter::NativeCallGlobal));
+                break;
+            case Instruction::RTN:
+                runtimeCallJump(address(Interpreter::NativeReturn));
+                break;
+            case Instruction::DUM:
+                runtimeCallNext(address(Interpreter::NativeDummy));
+                break;
+            case Instruction::POP:
+                a.alu(Alu::Sub, R13, 8);
+                break;
+            case Instruction::CONS:
+                runtimeCallNext(address(Interpreter::NativeCons));
+                break;
+            case Instruction::CAR:
+            case Instruction::CAR_C:
+            case Instruction::CDR:
+            case Instruction::CDR_C:
+                a.load(RAX, R13, -8);
+                a.test(RAX, GC::ImmediateTag);
+                bailout(NE);
+                a.compare32(RAX, Kind, static_cast<int32_t>(GC::CellKind::Cons));
+                bailout(NE);
+                a.load(RAX, RAX, opcode == Instruction::CAR || opcode == Instruction::CAR_C ? Car : Cdr);
+                a.store(R13, -8, RAX);
+                break;
+            case Instruction::CONSP: {
+                a.load(RAX, R13, -8);
+                loadValue(RCX, Nil);
+                a.test(RAX, GC::ImmediateTag);
+                size_t immediate = a.jcc(NE);
+                a.compare32(RAX, Kind, static_cast<int32_t>(GC::CellKind::Cons));
+                size_t notCons = a.jcc(NE);
+                loadValue(RCX, T);
+                a.bind(immediate);
+                a.bind(notCons);
+                a.store(R13, -8, RCX);
+                break;
+            }
+            // the operands are tagged, untagging one of them leaves the tag in the result, whose overflow is that of the 63bit integers
+            case Instruction::ADD:
+            case Instruction::ADD_II:
+                immediateOperands();
+                a.alu(Alu::Sub, RCX, 1);
+                a.alu(Alu::Add, RAX, RCX);
+                bailout(O);
+                replace();
+                break;
+            case Instruction::SUB:
+            case Instruction::SUB_II:
+                immediateOperands();
+                a.alu(Alu::Sub, RAX, RCX);
+                bailout(O);
+                a.alu(Alu::Or, RAX, 1);
+                replace();
+                break;
+            case Instruction::MUL:
+                immediateOperands();
+                a.sar(RCX);
+                a.alu(Alu::Sub, RAX, 1);
+                a.imul(RAX, RCX);
+                bailout(O);
+                a.alu(Alu::Or, RAX, 1);
+                replace();
+                break;
+            // division by zero throws and the only overflow is the division by -1, both are left to the interpreter
+            case Instruction::DIV:
+                immediateOperands();
+                a.sar(RAX);
+                a.sar(RCX);
+                a.alu(Alu::Cmp, RCX, 0);
+                bailout(E);
+                a.alu(Alu::Cmp, RCX, -1);
+                bailout(E);
+                a.idiv(RCX);
+                a.tag();
+                replace();
+                break;
+            case Instruction::LT:
+            case Instruction::LT_II:
+            case Instruction::GT:
+            case Instruction::GT_II:
+                immediateOperands();
+                a.alu(Alu::Cmp, RAX, RCX);
+                a.setImmediate(opcode == Instruction::LT || opcode == Instruction::LT_II ? L : G);
+                replace();
+                break;
+            case Instruction::LDC_LD0_ADD:
+                if (! localAndConstant()) {
+                    bailoutNow();
+                    break;
+                }
+                a.alu(Alu::Sub, RCX, 1);
+                a.alu(Alu::Add, RAX, RCX);
+                bailout(O);
+                push(RAX);
+                break;
+            case Instruction::LDC_LD0_SUB:
+                if (! localAndConstant()) {
+                    bailoutNow();
+                    break;
+                }
+                a.alu(Alu::Sub, RAX, RCX);
+                bailout(O);
+                a.alu(Alu::Or, RAX, 1);
+                push(RAX);
+                break;
+            case Instruction::LDC_LD0_LT:
+            case Instruction::LDC_LD0_GT:
+                if (! localAndConstant()) {
+                    bailoutNow();
+                    break;
+                }
+                a.alu(Alu::Cmp, RAX, RCX);
+                a.setImmediate(opcode == Instruction::LDC_LD0_LT ? L : G);
+                push(RAX);
+                break;
+            case Instruction::LDC_LD0_BLT:
+            case Instruction::LDC_LD0_BGT:
+                if (! localAndConstant()) {
+                    bailoutNow();
+                    break;
+                }
+                a.alu(Alu::Cmp, RAX, RCX);
+                branch(opcode == Instruction::LDC_LD0_BLT ? GE : LE, pc + code[pc + 3]);
+                break;
+            // an immediate integer constant is only equal to the same immediate
+            case Instruction::LDC_LD0_EQ:
+            case Instruction::LDC_LD0_BEQ: {
+                if (! bytecode.constant(code[pc + 1]).isImmediate()) {
+                    bailoutNow();
+                    break;
+                }
+                a.load(RAX, R15, slot(code[pc + 2]));
+                loadConstant(RCX, code[pc + 1]);
+                a.alu(Alu::Cmp, RAX, RCX);
+                if (opcode == Instruction::LDC_LD0_BEQ) {
+                    branch(NE, pc + code[pc + 3]);
+                } else {
+                    a.setImmediate(E);
+                    push(RAX);
+                }
+                break;
+            }
+            case Instruction::LD0_LD0_ADD:
+                a.load(RAX, R15, slot(code[pc + 2]));
+                a.load(RCX, R15, slot(code[pc + 1]));
+                a.mov(RDX, RAX);
+                a.alu(Alu::And, RDX, RCX);
+                a.test(RDX, GC::ImmediateTag);
+                bailout(E);
+                a.alu(Alu::Sub, RCX, 1);
+                a.alu(Alu::Add, RAX, RCX);
+                bailout(O);
+                push(RAX);
+                break;
+            default:
+                exitToInterpreter();
+                continue;
+            }
+            // falls through to the next instruction, unless it is not the next one emitted
+            auto following = std::next(i);
+            if (following == labels.end() || following->first != next) {
+                switch (opcode) {
+                case Instruction::JOIN:
+                case Instruction::AP:
+                case Instruction::TAP:
+                case Instruction::APN:
+                case Instruction::TAPN:
+                case Instruction::RAPN:
+                case Instruction::TRAPN:
+                case Instruction::LDG_APN:
+                case Instruction::LDG_TAPN:
+                case Instruction::RTN:
+                    break;
+                default:
+                    jump(next);
+                }
+            }
+        }
+        // bailouts exit to the interpreter at the instruction, whose operands are still on the stack
+        std::map<size_t, size_t> stubs;
+        for (auto const & b : bailouts) {
+            auto i = stubs.find(b.second);
+            if (i == stubs.end()) {
+                i = stubs.insert(std::make_pair(b.second, a.size())).first;
+                pc = b.second;
+                bailoutNow();
+            }
+            a.patch(b.first, i->second);
+        }
+        if (a.overflow()) {
+            full_ = true;
+            return nullptr;
+        }
+        for (auto const & j : jumps) {
+            assert(labels.count(j.second) != 0 && "Jump out of the function");
+            a.patch(j.first, labels[j.second]);
+        }
+        for (size_t e : exits)
+            a.patch(e, exitOffset_);
+        for (auto const & n : natives)
+            entries_[n.first].native = code_ + n.second;
+        size_ = a.size();
+        ++functions_;
+        return entries_[entry].native;
+    }
+
+#else
+
+    Jit::Jit(Interpreter & interpreter):
+        interpreter_(interpreter),
+        threshold_(0) {
+    }
+
+    Jit::~Jit() {
+    }
+
+    void Jit::setThreshold(size_t value) {
+    }
+
+    size_t Jit::run(void * native, size_t & count) {
+        assert(false && "JIT is not available");
+        return 0;
+    }
+
+    void Jit::initialize() {
+    }
+
+    void * Jit::compile(size_t entry) {
+        return nullptr;
+    }
+
+#endif
+
+} // namespace secd
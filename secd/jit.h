@@ -0,0 +1,167 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__linux__) && ! defined(SECD_NO_JIT) && ! defined(SECD_PROFILE_OPCODES)
+#define SECD_JIT
+#endif
+
+namespace secd {
+
+    class Interpreter;
+
+    /** Baseline template JIT which compiles the hot functions of the bytecode to x86-64 machine code.
+
+        The interpreter counts the invocations of each function entry and once the count reaches the threshold, the whole function body, i.e. the instructions reachable from the entry without a call, is compiled. Each instruction is translated to a fixed template of machine code that works on the same stack, environment and dump as the interpreter, so that interpreted and native code can call each other and return to each other freely. The native code is entered at the function entry and at the return address of each call in the function.
+
+        While in native code, rbx holds the interpreter, r12 the number of instructions executed, r13 the top of the stack and r14 and r15 the current environment frame and its slots. Cell pointers are only kept in the registers until the next runtime call, as any allocation may move the cells. The runtime calls are static members of the Interpreter, which execute the instructions that allocate or change the environment, i.e. LDF, CONS, DUM, the calls and RTN, as their handlers do. Calls and returns continue directly with the native code of their target, if it has been compiled, so that the machine stack does not grow.
+
+        The operator templates only handle immediate integers. Other operands, as well as instructions with no template (DEFUN, PRINT, READ and STOP) exit the native code, the interpreter executes the instruction itself and continues until the next call or return. The native code therefore reports no errors of its own, errors thrown by the runtime calls cannot unwind through the native code and are rethrown once it exits.
+
+        The JIT is only available on Linux x86-64 and is disabled if SECD_NO_JIT or SECD_PROFILE_OPCODES is defined. The threshold is read from the SECD_JIT_THRESHOLD environment variable, 0 disables the JIT and invalid values are ignored as those of the GC settings are.
+     */
+    class Jit {
+    public:
+
+        static size_t constexpr DefaultThreshold = 100;
+
+        /** Size of the address space reserved for the native code, functions are no longer compiled once it is full.
+         */
+        static size_t constexpr CodeSize = 64 * 1024 * 1024;
+
+        explicit Jit(Interpreter & interpreter);
+
+        ~Jit();
+
+        Jit(Jit const &) = delete;
+
+        Jit & operator = (Jit const &) = delete;
+
+        size_t threshold() const {
+            return threshold_;
+        }
+
+        /** Sets the number of invocations after which a function is compiled, 0 disables the JIT including the functions compiled already.
+         */
+        void setThreshold(size_t value);
+
+        /** Number of functions compiled so far.
+         */
+        size_t functions() const {
+            return functions_;
+        }
+
+        /** Bytes of native code generated so far.
+         */
+        size_t codeSize() const {
+            return size_;
+        }
+
+        /** Makes room for the counters of the bytecode of the given size, called whenever more bytecode is lowered.
+         */
+        void resize(size_t size) {
+            entries_.resize(size);
+        }
+
+        /** Counts the invocation of the function with the given entry and returns its native code, compiling it if it has become hot. Returns nullptr if the function is to be interpreted.
+         */
+        void * enter(size_t entry) {
+            if (threshold_ == 0)
+                return nullptr;
+            Entry & e = entries_[entry];
+            if (e.native != nullptr || ++e.count < threshold_)
+                return e.native;
+            return compile(entry);
+        }
+
+        /** Returns the native code of the given return address, or nullptr if its function has not been compiled.
+         */
+        void * resume(size_t pc) const {
+            if (threshold_ == 0)
+                return nullptr;
+            return entries_[pc].native;
+        }
+
+        /** Runs the native code until it exits to the interpreter and returns the offset at which the interpreter continues. The instructions executed by the native code are added to the count.
+         */
+        size_t run(void * native, size_t & count);
+
+        /** Returns the native code to continue with from a runtime call, i.e. the given code or the exit to the interpreter at pc if it is nullptr.
+         */
+        void * jump(void * native, size_t pc) {
+            if (native != nullptr)
+                return native;
+            exit_ = pc;
+            return exit();
+        }
+
+        /** Records the error thrown by a runtime call and returns the exit of the native code, which rethrows it.
+         */
+        void * fail(std::exception_ptr error) {
+            error_ = error;
+            return exit();
+        }
+
+    private:
+
+        struct Entry {
+            void * native = nullptr;
+            size_t count = 0;
+        };
+
+        /** Compiles the function with the given entry and returns its native code, or nullptr if there is no space left for it.
+         */
+        void * compile(size_t entry);
+
+        /** Maps the memory for the native code and generates the code which enters and exits it.
+
+            The memory is mapped twice, the code is written to a mapping which is only writable and executed from one which is only executable, so that no page is ever writable and executable at once. If the memory cannot be mapped so, no functions are compiled.
+         */
+        void initialize();
+
+        void * exit() const {
+            return code_ + exitOffset_;
+        }
+
+        Interpreter & interpreter_;
+
+        size_t threshold_;
+
+        /** Native code and invocation count of each function entry, indexed by the bytecode offset.
+         */
+        std::vector<Entry> entries_;
+
+        /** The executable mapping of the native code.
+         */
+        uint8_t * code_ = nullptr;
+
+        /** The writable mapping of the same memory, the code is generated through it.
+         */
+        uint8_t * writable_ = nullptr;
+
+        size_t size_ = 0;
+
+        size_t exitOffset_ = 0;
+
+        size_t functions_ = 0;
+
+        /** Set once the space for the native code has run out.
+         */
+        bool full_ = false;
+
+        /** Offset at which the interpreter continues when the native code exits.
+         */
+        size_t exit_ = 0;
+
+        /** Instructions executed by the native code since it was entered.
+         */
+        size_t executed_ = 0;
+
+        std::exception_ptr error_;
+
+    }; // secd::Jit
+
+} // namespace secd
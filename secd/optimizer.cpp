@@ -0,0 +1,434 @@
+#include <algorithm>
+#include <vector>
+
+#include "runtime.h"
+#include "optimizer.h"
+
+namespace secd {
+
+    namespace {
+
+        /** Returns the length of a proper list, SIZE_MAX otherwise.
+         */
+        size_t length(ValueRef list) {
+            size_t result = 0;
+            for (; list.isCons(); list = list.cdr())
+                ++result;
+            return list == Nil ? result : SIZE_MAX;
+        }
+
+        bool addOverflows(int64_t lhs, int64_t rhs) {
+            return rhs > 0 ? lhs > INT64_MAX - rhs : lhs < INT64_MIN - rhs;
+        }
+
+        bool subOverflows(int64_t lhs, int64_t rhs) {
+            return rhs > 0 ? lhs < INT64_MIN + rhs : lhs > INT64_MAX + rhs;
+        }
+
+        bool mulOverflows(int64_t lhs, int64_t rhs) {
+            if (lhs == 0 || rhs == 0)
+                return false;
+            if (lhs > 0)
+                return rhs > 0 ? lhs > INT64_MAX / rhs : rhs < INT64_MIN / lhs;
+            return rhs > 0 ? lhs < INT64_MIN / rhs : rhs < INT64_MAX / lhs;
+        }
+
+        /** Returns true if calls with the symbol in function position are compiled as special forms or operators instead of reading the variable.
+         */
+        bool isSpecial(ValueRef symbol) {
+            return symbol == Symbol::Cons || symbol == Symbol::Car || symbol == Symbol::Cdr || symbol == Symbol::Consp
+                || symbol == Symbol::Add || symbol == Symbol::Sub || symbol == Symbol::Mul || symbol == Symbol::Div
+                || symbol == Symbol::Eq || symbol == Symbol::Lt || symbol == Symbol::Gt || symbol == Symbol::Print
+                || symbol == Symbol::Read || symbol == Symbol::If || symbol == Symbol::Lambda || symbol == Symbol::Quote
+                || symbol == Symbol::Apply || symbol == Symbol::Defun || symbol == Symbol::Let || symbol == Symbol::Letrec
+                || symbol == Symbol::Progn;
+        }
+
+        bool isVariable(ValueRef expr) {
+            return expr.isSymbol() && expr != Nil && expr != Symbol::T;
+        }
+
+        bool contains(ValueRef list, ValueRef item) {
+            for (; list.isCons(); list = list.cdr())
+                if (list.car() == item)
+                    return true;
+            return false;
+        }
+
+        /** Returns the number of atoms in the expression.
+         */
+        size_t size(ValueRef expr) {
+            if (! expr.isCons())
+                return 1;
+            size_t result = 0;
+            for (; expr.isCons(); expr = expr.cdr())
+                result += size(expr.car());
+            return result;
+        }
+
+        /** Adds the global variables used by the function body, returns false if the body cannot be inlined.
+
+            The body can be inlined if it consists of constants, variables and calls only and it does not call the function itself. Bodies with lambdas or let forms are not inlined so that the substituted arguments cannot be captured by their variables.
+         */
+        bool collectGlobals(ValueRef expr, ValueRef name, ValueRef params, std::vector<std::string> & globals) {
+            if (isVariable(expr)) {
+                if (expr == name)
+                    return false;
+                if (! contains(params, expr))
+                    globals.push_back(expr.name());
+                return true;
+            }
+            if (! expr.isCons())
+                return true;
+            if (length(expr) == SIZE_MAX)
+                return false;
+            ValueRef fname = expr.car();
+            if (fname == Symbol::Quote)
+                return true;
+            if (fname == Symbol::Lambda || fname == Symbol::Defun || fname == Symbol::Let || fname == Symbol::Letrec)
+                return false;
+            if (isSpecial(fname))
+                expr = expr.cdr();
+            for (; expr.isCons(); expr = expr.cdr())
+                if (! collectGlobals(expr.car(), name, params, globals))
+                    return false;
+            return true;
+        }
+
+        /** Counts the uses of the variable in an expression which has no bindings, conditional is set if any of them is in a conditional arm.
+         */
+        void countUses(ValueRef expr, ValueRef var, bool inArm, size_t & uses, bool & conditional) {
+            if (expr == var) {
+                ++uses;
+                conditional = conditional || inArm;
+                return;
+            }
+            if (! expr.isCons() || expr.car() == Symbol::Quote)
+                return;
+            if (expr.car() == Symbol::If) {
+                expr = expr.cdr();
+                countUses(expr.car(), var, inArm, uses, conditional);
+                for (expr = expr.cdr(); expr.isCons(); expr = expr.cdr())
+                    countUses(expr.car(), var, true, uses, conditional);
+                return;
+            }
+            for (; expr.isCons(); expr = expr.cdr())
+                countUses(expr.car(), var, inArm, uses, conditional);
+        }
+
+        /** Returns true if evaluating the expression has no side effects, i.e. it only applies operators to constants and variables.
+         */
+        bool isPure(ValueRef expr) {
+            if (! expr.isCons())
+                return true;
+            ValueRef fname = expr.car();
+            if (fname == Symbol::Quote)
+                return true;
+            if (! (fname == Symbol::Add || fname == Symbol::Sub || fname == Symbol::Mul || fname == Symbol::Div
+                    || fname == Symbol::Eq || fname == Symbol::Lt || fname == Symbol::Gt || fname == Symbol::Cons
+                    || fname == Symbol::Car || fname == Symbol::Cdr || fname == Symbol::Consp || fname == Symbol::If)
+                || length(expr) == SIZE_MAX)
+                return false;
+            for (expr = expr.cdr(); expr.isCons(); expr = expr.cdr())
+                if (! isPure(expr.car()))
+                    return false;
+            return true;
+        }
+
+        /** Replaces the parameters in an expression without bindings with the respective arguments.
+         */
+        Value substitute(Value const & expr, Value const & params, Value const & args) {
+            if (isVariable(expr)) {
+                Value a = args;
+                for (Value p = params; p != Nil; p = p.cdr(), a = a.cdr())
+                    if (p.car() == expr)
+                        return a.car();
+                return expr;
+            }
+            if (! expr.isCons() || expr.car() == Symbol::Quote)
+                return expr;
+            Value rest = expr.cdr().isCons() ? substitute(expr.cdr(), params, args) : expr.cdr();
+            // names of special forms and operators are not variables
+            if (expr.car().isSymbol() && isSpecial(expr.car()))
+                return Value::Cons(expr.car(), rest);
+            return Value::Cons(substitute(expr.car(), params, args), rest);
+        }
+
+    } // anonymous namespace
+
+    Value Optimizer::optimize(Value const & expr) {
+        if (! enabled_)
+            return expr;
+        return simplify(expr);
+    }
+
+    void Optimizer::print(std::ostream & s) const {
+        s << "Folded operators:    " << stats_.folded << std::endl;
+        s << "Eliminated branches: " << stats_.branches << std::endl;
+        s << "Dropped constants:   " << stats_.dropped << std::endl;
+        s << "Collapsed progns:    " << stats_.progns << std::endl;
+        s << "Inlined calls:       " << stats_.inlined << std::endl;
+    }
+
+    Value Optimizer::simplify(Value const & expr) {
+        if (! expr.isCons())
+            return expr;
+        Value fname = expr.car();
+        if (fname == Symbol::Quote)
+            return expr;
+        // (lambda args body)
+        if (fname == Symbol::Lambda) {
+            Value params = expr.cdr().isCons() ? expr.cdr().car() : Nil;
+            bind(params);
+            Value result = optimizeFrom(expr, 2);
+            unbind(params);
+            return result;
+        }
+        // (defun name args body)
+        if (fname == Symbol::Defun)
+            return optimizeDefun(expr);
+        // (let names values body), where values is a list of expressions
+        if (fname == Symbol::Let || fname == Symbol::Letrec) {
+            if (length(expr) != 4)
+                return expr;
+            Value names = expr.cdr();
+            Value values = names.cdr();
+            // the values of let are evaluated in the enclosing scope, those of letrec in the new one
+            if (fname == Symbol::Letrec)
+                bind(names.car());
+            Value init = optimizeFrom(values.car(), 0);
+            if (fname == Symbol::Let)
+                bind(names.car());
+            Value body = optimizeFrom(values.cdr(), 0);
+            unbind(names.car());
+            return Value::Cons(fname, Value::Cons(names.car(), Value::Cons(init, body)));
+        }
+        if (fname == Symbol::If)
+            return optimizeIf(optimizeFrom(expr, 1));
+        if (fname == Symbol::Progn)
+            return optimizeProgn(optimizeFrom(expr, 1));
+        if (fname.isSymbol() && ! isSpecial(fname))
+            return inlineCall(optimizeFrom(expr, 1));
+        return fold(optimizeFrom(expr, fname.isSymbol() ? 1 : 0));
+    }
+
+    Value Optimizer::optimizeDefun(Value const & expr) {
+        // malformed definitions are left for the compiler to report
+        if (length(expr) != 4 || ! expr.cdr().car().isSymbol())
+            return optimizeFrom(expr, 3);
+        Value name = expr.cdr().car();
+        Value params = expr.cdr().cdr().car();
+        // forget the function and the functions which would call the new definition if inlined, but the old one if called
+        std::vector<std::string> forgotten;
+        for (auto const & i : functions_) {
+            std::vector<std::string> const & globals = i.second.globals;
+            if (i.first == name.name() || std::find(globals.begin(), globals.end(), name.name()) != globals.end())
+                forgotten.push_back(i.first);
+        }
+        for (std::string const & f : forgotten)
+            setFunction(f, nullptr);
+        bind(params);
+        Value result = optimizeFrom(expr, 3);
+        unbind(params);
+        if (inlineThreshold_ == 0 || length(params) == SIZE_MAX)
+            return result;
+        for (Value p = params; p != Nil; p = p.cdr())
+            if (! isVariable(p.car()) || isSpecial(p.car()) || contains(p.cdr(), p.car()))
+                return result;
+        Value body = result.cdr().cdr().cdr().car();
+        Inlinable f;
+        if (size(body) <= inlineThreshold_ && collectGlobals(body, name, params, f.globals)) {
+            f.code = code_.size();
+            code_.push(params);
+            code_.push(body);
+            setFunction(name.name(), & f);
+        }
+        return result;
+    }
+
+    void Optimizer::rollback() {
+        for (auto i = changes_.rbegin(); i != changes_.rend(); ++i) {
+            if (i->existed)
+                functions_[i->name] = i->previous;
+            else
+                functions_.erase(i->name);
+        }
+        changes_.clear();
+        code_.truncate(committedCode_);
+        locals_.clear();
+    }
+
+    void Optimizer::setFunction(std::string const & name, Inlinable const * f) {
+        auto i = functions_.find(name);
+        if (i == functions_.end()) {
+            changes_.push_back(Change{name, false, Inlinable()});
+        } else {
+            changes_.push_back(Change{name, true, i->second});
+            functions_.erase(i);
+        }
+        if (f != nullptr)
+            functions_[name] = *f;
+    }
+
+    Value Optimizer::inlineCall(Value const & expr) {
+        Value fname = expr.car();
+        if (isLocal(fname.name()))
+            return expr;
+        auto i = functions_.find(fname.name());
+        if (i == functions_.end() || i->second.expanding)
+            return expr;
+        Inlinable & f = i->second;
+        Value params = code_[f.code];
+        Value body = code_[f.code + 1];
+        Value args = expr.cdr();
+        if (length(args) != length(params))
+            return expr;
+        for (std::string const & global : f.globals)
+            if (isLocal(global))
+                return expr;
+        Value a = args;
+        for (Value p = params; p != Nil; p = p.cdr(), a = a.cdr()) {
+            Value arg = a.car();
+            if (IsConstant(arg) || arg.isSymbol())
+                continue;
+            size_t uses = 0;
+            bool conditional = false;
+            countUses(body, p.car(), false, uses, conditional);
+            if (uses != 1 || conditional || ! isPure(arg))
+                return expr;
+        }
+        ++stats_.inlined;
+        f.expanding = true;
+        Value result = substitute(body, params, args);
+        // no new functions are defined while simplifying the body, so the reference to the function stays valid
+        result = simplify(result);
+        f.expanding = false;
+        return result;
+    }
+
+    void Optimizer::bind(Value names) {
+        for (; names.isCons(); names = names.cdr())
+            if (names.car().isSymbol())
+                ++locals_[names.car().name()];
+    }
+
+    void Optimizer::unbind(Value names) {
+        for (; names.isCons(); names = names.cdr()) {
+            if (! names.car().isSymbol())
+                continue;
+            auto i = locals_.find(names.car().name());
+            if (--i->second == 0)
+                locals_.erase(i);
+        }
+    }
+
+    Value Optimizer::optimizeIf(Value const & expr) {
+        // malformed conditionals are left for the compiler to report
+        if (length(expr) != 4)
+            return expr;
+        Value args = expr.cdr();
+        Value condition = args.car();
+        if (! IsConstant(condition))
+            return expr;
+        ++stats_.branches;
+        args = args.cdr();
+        return toBoolean(ConstantValue(condition)) ? args.car() : args.cdr().car();
+    }
+
+    Value Optimizer::optimizeProgn(Value const & expr) {
+        if (length(expr) == SIZE_MAX)
+            return expr;
+        // the nested progns have been flattened already
+        std::vector<Value> items;
+        for (Value x = expr.cdr(); x != Nil; x = x.cdr()) {
+            Value item = x.car();
+            if (item.isCons() && item.car() == Symbol::Progn) {
+                ++stats_.progns;
+                for (Value y = item.cdr(); y != Nil; y = y.cdr())
+                    items.push_back(y.car());
+            } else {
+                items.push_back(item);
+            }
+        }
+        Value result = Nil;
+        for (size_t i = items.size(); i > 0; --i) {
+            if (i != items.size() && IsConstant(items[i - 1])) {
+                ++stats_.dropped;
+                continue;
+            }
+            result = Value::Cons(items[i - 1], result);
+        }
+        if (result == Nil || result.cdr() == Nil) {
+            ++stats_.progns;
+            return result == Nil ? Nil : result.car();
+        }
+        return Value::Cons(Symbol::Progn, result);
+    }
+
+    Value Optimizer::fold(Value const & expr) {
+        Value op = expr.car();
+        if (! op.isSymbol() || length(expr) != 3)
+            return expr;
+        Value lhsExpr = expr.cdr().car();
+        Value rhsExpr = expr.cdr().cdr().car();
+        if (! IsConstant(lhsExpr) || ! IsConstant(rhsExpr))
+            return expr;
+        Value lhs = ConstantValue(lhsExpr);
+        Value rhs = ConstantValue(rhsExpr);
+        if (op == Symbol::Eq) {
+            // symbols are interned, other values are only equal to themselves, which is not known for quoted lists
+            if (lhs.isInteger() && rhs.isInteger()) {
+                ++stats_.folded;
+                return Value::Integer(lhs.valueInt() == rhs.valueInt());
+            }
+            if (lhs.isSymbol() && rhs.isSymbol()) {
+                ++stats_.folded;
+                return Value::Integer(lhs == rhs);
+            }
+            return expr;
+        }
+        if (! lhs.isInteger() || ! rhs.isInteger())
+            return expr;
+        int64_t l = lhs.valueInt();
+        int64_t r = rhs.valueInt();
+        int64_t result;
+        if (op == Symbol::Add && ! addOverflows(l, r))
+            result = l + r;
+        else if (op == Symbol::Sub && ! subOverflows(l, r))
+            result = l - r;
+        else if (op == Symbol::Mul && ! mulOverflows(l, r))
+            result = l * r;
+        else if (op == Symbol::Div && r != 0 && ! (l == INT64_MIN && r == -1))
+            result = l / r;
+        else if (op == Symbol::Lt)
+            result = l < r;
+        else if (op == Symbol::Gt)
+            result = l > r;
+        else
+            return expr;
+        ++stats_.folded;
+        return Value::Integer(result);
+    }
+
+    Value Optimizer::optimizeFrom(Value const & list, size_t first) {
+        if (! list.isCons())
+            return list;
+        Value rest = optimizeFrom(list.cdr(), first == 0 ? 0 : first - 1);
+        return Value::Cons(first == 0 ? simplify(list.car()) : list.car(), rest);
+    }
+
+    bool Optimizer::IsConstant(Value const & expr) {
+        if (expr.isInteger() || expr == Nil || expr == Symbol::T)
+            return true;
+        return expr.isCons() && expr.car() == Symbol::Quote && expr.cdr().isCons() && expr.cdr().cdr() == Nil;
+    }
+
+    Value Optimizer::ConstantValue(Value const & expr) {
+        if (expr == Symbol::T)
+            return T;
+        if (expr.isCons())
+            return expr.cdr().car();
+        return expr;
+    }
+
+} // namespace secd
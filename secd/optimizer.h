@@ -0,0 +1,179 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "data_types.h"
+#include "value.h"
+
+namespace secd {
+
+    /** Simplifies the s-expressions before they are compiled.
+
+        The optimizer folds the arithmetic and comparison operators whose operands are constants, replaces conditionals with constant condition by the arm taken and flattens progn, dropping the constants whose values are discarded. Constants are integers, nil, t and quoted values. Operators which would fail or overflow at runtime are left as they are so that the error is still reported when the code runs.
+
+        Small global functions are inlined at their call sites. A function defined by defun is remembered if it is not recursive, its body is not larger than the inline threshold and does not bind any variables. A call to it is replaced by its body with the arguments substituted for the parameters when neither the function, nor any global its body uses is shadowed by a local variable at the call site, and when the substitution evaluates the arguments the same as the call would. That is when each argument is either a constant or a variable, or an expression without side effects whose parameter is used exactly once and not in a conditional arm. Errors raised by such an argument, e.g. a type error, may be reported after the side effects of the body preceding the use.
+
+        Global functions are bound early, i.e. a redefinition gets a new global slot and the code compiled before it keeps calling the old definition, see Compiler::EnvironmentMap::addSymbol(). The code a function has been inlined into thus behaves the same as if it was called and the function can be redefined freely. The functions whose bodies call the redefined function are forgotten, as their inlined bodies would call the new definition while their calls use the old one.
+     */
+    class Optimizer {
+    public:
+
+        struct Stats {
+            /** Operators evaluated at compile time.
+             */
+            size_t folded = 0;
+
+            /** Conditionals replaced by one of their arms.
+             */
+            size_t branches = 0;
+
+            /** Constants removed from progn.
+             */
+            size_t dropped = 0;
+
+            /** Progn forms merged into the enclosing progn, or replaced by their only expression.
+             */
+            size_t progns = 0;
+
+            /** Calls replaced by the body of the function.
+             */
+            size_t inlined = 0;
+        }; // Optimizer::Stats
+
+        /** Default maximum size of the body of an inlined function, in atoms.
+         */
+        static size_t constexpr DefaultInlineThreshold = 16;
+
+        /** Returns the simplified top level expression, or the expression itself if the optimizer is disabled.
+
+            The functions defined by the expression are only remembered for inlining once the compilation of the expression is committed.
+         */
+        Value optimize(Value const & expr);
+
+        /** Remembers the functions defined by the last optimized expression, to be called once the expression has been compiled.
+         */
+        void commit() {
+            changes_.clear();
+            committedCode_ = code_.size();
+        }
+
+        /** Forgets the functions defined by the last optimized expression, to be called if the expression failed to compile.
+         */
+        void rollback();
+
+        /** Sets the maximum size of the body of an inlined function, 0 disables inlining.
+         */
+        void setInlineThreshold(size_t atoms) {
+            inlineThreshold_ = atoms;
+        }
+
+        size_t inlineThreshold() const {
+            return inlineThreshold_;
+        }
+
+        bool enabled() const {
+            return enabled_;
+        }
+
+        void setEnabled(bool value) {
+            enabled_ = value;
+        }
+
+        Stats const & stats() const {
+            return stats_;
+        }
+
+        void print(std::ostream & s) const;
+
+    private:
+
+        /** Function which can be inlined.
+         */
+        struct Inlinable {
+            /** Index of the parameters in the code of the functions, the body follows them.
+             */
+            size_t code = 0;
+            /** Global variables used by the body, which must not be shadowed at the call site.
+             */
+            std::vector<std::string> globals;
+            /** Whether the function is being inlined, so that the inlined body does not inline it again.
+             */
+            bool expanding = false;
+        };
+
+        /** Change of the inlinable functions since the last commit, i.e. the previous entry of the function, if any.
+         */
+        struct Change {
+            std::string name;
+            bool existed;
+            Inlinable previous;
+        };
+
+        /** Sets or erases the inlinable function, recording the change so that it can be rolled back.
+         */
+        void setFunction(std::string const & name, Inlinable const * f);
+
+        Value simplify(Value const & expr);
+
+        /** Optimizes the function body and remembers the function if it can be inlined.
+         */
+        Value optimizeDefun(Value const & expr);
+
+        /** Returns the body of the called function with the arguments substituted, or the call itself if the function cannot be inlined there.
+         */
+        Value inlineCall(Value const & expr);
+
+        bool isLocal(std::string const & name) const {
+            return locals_.find(name) != locals_.end();
+        }
+
+        void bind(Value names);
+
+        void unbind(Value names);
+
+        Value optimizeIf(Value const & expr);
+
+        Value optimizeProgn(Value const & expr);
+
+        /** Folds binary operator with constant operands, returns the expression itself if it cannot be folded.
+         */
+        Value fold(Value const & expr);
+
+        /** Optimizes the elements of the list starting with the given one, the elements before are kept as they are.
+         */
+        Value optimizeFrom(Value const & list, size_t first);
+
+        static bool IsConstant(Value const & expr);
+
+        /** Returns the value of a constant expression.
+         */
+        static Value ConstantValue(Value const & expr);
+
+        bool enabled_ = true;
+
+        size_t inlineThreshold_ = DefaultInlineThreshold;
+
+        Stats stats_;
+
+        std::unordered_map<std::string, Inlinable> functions_;
+
+        /** Parameters and bodies of the inlinable functions, kept in a single root range rather than rooted one by one, as there may be many of them. The code of a redefined function is kept as the code compiled before may still call it.
+         */
+        ValueStack code_;
+
+        size_t committedCode_ = 0;
+
+        /** Changes of the functions since the last commit in the order they were made, so that the expression which fails to compile can be undone without copying all the functions for every expression.
+         */
+        std::vector<Change> changes_;
+
+        /** Number of bindings of the local variables in scope at the current position.
+         */
+        std::unordered_map<std::string, size_t> locals_;
+
+    }; // secd::Optimizer
+
+} // namespace secd
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <iomanip>
 #include <iostream>
 
 #include "runtime.h"
@@ -20,11 +22,17 @@ namespace secd {
                 case Instruction::LDC:
                     std::cout << "LDC " << c.pop() << std::endl;
                     break;
-                case Instruction::LD:
-                    std::cout << "LD " << c.pop() << std::endl;
+                case Instruction::LD: {
+                    int64_t address = c.pop().valueInt();
+                    std::cout << "LD " << Instruction::AddressDepth(address) << " " << Instruction::AddressOffset(address) << std::endl;
                     break;
+                }
                 case Instruction::SEL: 
-                    std::cout << "SEL" << std::endl;
+                case Instruction::BLT:
+                case Instruction::BGT:
+                case Instruction::BEQ:
+                case Instruction::BNIL:
+                    std::cout << (opcode == Instruction::SEL ? "SEL" : opcode == Instruction::BLT ? "BLT" : opcode == Instruction::BGT ? "BGT" : opcode == Instruction::BEQ ? "BEQ" : "BNIL") << std::endl;
                     printCodeWithOffset(c.pop(), offset + 4);
                     std::cout << "else" << std::endl;
                     printCodeWithOffset(c.pop(), offset + 4);
@@ -33,9 +41,20 @@ namespace secd {
                     std::cout << "JOIN" << std::endl;
                     break;
                 case Instruction::LDF:
-                    std::cout << "LDF" << std::endl;
+                    std::cout << "LDF " << c.pop() << std::endl;
                     printCodeWithOffset(c.pop(), offset + 4);
                     break;
+                case Instruction::LDG:
+                    std::cout << "LDG " << c.pop() << std::endl;
+                    break;
+                case Instruction::LDE:
+                    std::cout << "LDE " << c.pop() << std::endl;
+                    break;
+                case Instruction::LDB: {
+                    int64_t address = c.pop().valueInt();
+                    std::cout << "LDB " << Instruction::AddressDepth(address) << " " << Instruction::AddressOffset(address) << " " << c.pop() << std::endl;
+                    break;
+                }
                 case Instruction::AP:
                     std::cout << "AP" << std::endl;
                     break;
@@ -45,11 +64,11 @@ namespace secd {
                 case Instruction::DUM:
                     std::cout << "DUM" << std::endl;
                     break;
-                case Instruction::RAP:
-                    std::cout << "RAP" << std::endl;
+                case Instruction::RAPN:
+                    std::cout << "RAPN " << c.pop() << std::endl;
                     break;
                 case Instruction::DEFUN:
-                    std::cout << "DEFUN " << std::endl;
+                    std::cout << "DEFUN " << c.pop() << std::endl;
                     break;
                 case Instruction::POP:
                     std::cout << "POP" << std::endl;
@@ -93,11 +112,87 @@ namespace secd {
                 case Instruction::READ:
                     std::cout << "READ" << std::endl;
                     break;
+                case Instruction::TAP:
+                    std::cout << "TAP" << std::endl;
+                    break;
+                case Instruction::TRAPN:
+                    std::cout << "TRAPN " << c.pop() << std::endl;
+                    break;
+                case Instruction::APN:
+                    std::cout << "APN " << c.pop() << std::endl;
+                    break;
+                case Instruction::TAPN:
+                    std::cout << "TAPN " << c.pop() << std::endl;
+                    break;
                 default:
                     std::cout << "!!! Undefined opcode " << opcode;
                 }
             }
         }
+
+        char const * mnemonic(uint32_t opcode) {
+            switch (opcode) {
+            case Instruction::NIL: return "NIL";
+            case Instruction::LDC: return "LDC";
+            case Instruction::LD: return "LD";
+            case Instruction::SEL: return "SEL";
+            case Instruction::JOIN: return "JOIN";
+            case Instruction::LDF: return "LDF";
+            case Instruction::AP: return "AP";
+            case Instruction::RTN: return "RTN";
+            case Instruction::DUM: return "DUM";
+            case Instruction::RAPN: return "RAPN";
+            case Instruction::DEFUN: return "DEFUN";
+            case Instruction::POP: return "POP";
+            case Instruction::STOP: return "STOP";
+            case Instruction::CONS: return "CONS";
+            case Instruction::CAR: return "CAR";
+            case Instruction::CDR: return "CDR";
+            case Instruction::CONSP: return "CONSP";
+            case Instruction::ADD: return "ADD";
+            case Instruction::SUB: return "SUB";
+            case Instruction::MUL: return "MUL";
+            case Instruction::DIV: return "DIV";
+            case Instruction::EQ: return "EQ";
+            case Instruction::LT: return "LT";
+            case Instruction::GT: return "GT";
+            case Instruction::PRINT: return "PRINT";
+            case Instruction::READ: return "READ";
+            case Instruction::LD0: return "LD0";
+            case Instruction::LD1: return "LD1";
+            case Instruction::TAP: return "TAP";
+            case Instruction::TRAPN: return "TRAPN";
+            case Instruction::APN: return "APN";
+            case Instruction::TAPN: return "TAPN";
+            case Instruction::BLT: return "BLT";
+            case Instruction::BGT: return "BGT";
+            case Instruction::BEQ: return "BEQ";
+            case Instruction::BNIL: return "BNIL";
+            case Instruction::LDC_LD0_ADD: return "LDC_LD0_ADD";
+            case Instruction::LDC_LD0_SUB: return "LDC_LD0_SUB";
+            case Instruction::LDC_LD0_LT: return "LDC_LD0_LT";
+            case Instruction::LDC_LD0_GT: return "LDC_LD0_GT";
+            case Instruction::LDC_LD0_EQ: return "LDC_LD0_EQ";
+            case Instruction::LD0_LD0_ADD: return "LD0_LD0_ADD";
+            case Instruction::LDG_APN: return "LDG_APN";
+            case Instruction::LDG_TAPN: return "LDG_TAPN";
+            case Instruction::LDC_LD0_BLT: return "LDC_LD0_BLT";
+            case Instruction::LDC_LD0_BGT: return "LDC_LD0_BGT";
+            case Instruction::LDC_LD0_BEQ: return "LDC_LD0_BEQ";
+            case Instruction::ADD_II: return "ADD_II";
+            case Instruction::SUB_II: return "SUB_II";
+            case Instruction::LT_II: return "LT_II";
+            case Instruction::GT_II: return "GT_II";
+            case Instruction::EQ_II: return "EQ_II";
+            case Instruction::EQ_SYM: return "EQ_SYM";
+            case Instruction::CAR_C: return "CAR_C";
+            case Instruction::CDR_C: return "CDR_C";
+            case Instruction::LDG: return "LDG";
+            case Instruction::LDE: return "LDE";
+            case Instruction::LDB: return "LDB";
+            default: return nullptr;
+            }
+        }
         
     } // anonymous namespace
 
@@ -105,13 +200,87 @@ namespace secd {
         printCodeWithOffset(code, 0);
     }
 
+    void printCode(Bytecode const & code) {
+        size_t pc = 0;
+        while (pc < code.size()) {
+            uint32_t opcode = code[pc];
+            char const * name = mnemonic(opcode);
+            std::cout << std::setw(6) << pc << "  ";
+            if (name == nullptr) {
+                std::cout << "!!! Undefined opcode " << opcode << std::endl;
+                ++pc;
+                continue;
+            }
+            std::cout << name;
+            switch (opcode) {
+            case Instruction::LDC:
+                std::cout << " " << code[pc + 1] << " ; " << code.constant(code[pc + 1]);
+                break;
+            case Instruction::LD:
+                std::cout << " " << code[pc + 1] << " " << code[pc + 2];
+                break;
+            case Instruction::LD0:
+            case Instruction::LD1:
+            case Instruction::LDG:
+            case Instruction::LDE:
+            case Instruction::DEFUN:
+            case Instruction::APN:
+            case Instruction::TAPN:
+            case Instruction::RAPN:
+            case Instruction::TRAPN:
+                std::cout << " " << code[pc + 1];
+                break;
+            case Instruction::LDG_APN:
+            case Instruction::LDG_TAPN:
+                std::cout << " " << code[pc + 1] << " " << code[pc + 2];
+                break;
+            case Instruction::LDB:
+                std::cout << " " << code[pc + 1] << " " << code[pc + 2] << " " << code[pc + 3];
+                break;
+            case Instruction::LDC_LD0_ADD:
+            case Instruction::LDC_LD0_SUB:
+            case Instruction::LDC_LD0_LT:
+            case Instruction::LDC_LD0_GT:
+            case Instruction::LDC_LD0_EQ:
+                std::cout << " " << code[pc + 1] << " " << code[pc + 2] << " ; " << code.constant(code[pc + 1]);
+                break;
+            case Instruction::LD0_LD0_ADD:
+                std::cout << " " << code[pc + 1] << " " << code[pc + 2];
+                break;
+            case Instruction::LDC_LD0_BLT:
+            case Instruction::LDC_LD0_BGT:
+            case Instruction::LDC_LD0_BEQ:
+                std::cout << " " << code[pc + 1] << " " << code[pc + 2] << " -> " << pc + code[pc + 3] << " ; " << code.constant(code[pc + 1]);
+                break;
+            case Instruction::SEL:
+            case Instruction::BLT:
+            case Instruction::BGT:
+            case Instruction::BEQ:
+            case Instruction::BNIL:
+            case Instruction::JOIN:
+                // relative targets are shown as absolute offsets
+                std::cout << " -> " << pc + code[pc + 1];
+                break;
+            case Instruction::LDF:
+                std::cout << " " << code[pc + 1] << " -> " << code[pc + 2];
+                break;
+            default:
+                break;
+            }
+            std::cout << std::endl;
+            pc += 1 + Bytecode::OperandCount(opcode);
+        }
+    }
+
     Value Compiler::compileSource(Value const & code) {
         assert(envMap_ != nullptr && envMap_->parent() == nullptr && "Valid global env assumed");
         assert(code_ == nullptr && "Leftover code object detected");
         try {
             // initialize the output code
             code_ = new Code(nullptr);
-            compile(code);
+            compile(optimizer_.optimize(code));
+            optimizer_.commit();
+            envMap_->commit();
             Value res = *code_;
             assert(code_->parent() == nullptr && "Global code object expected after successful compilation");
             delete code_;
@@ -120,15 +289,17 @@ namespace secd {
             
         } catch (...) {
             // clear the code buffer and unroll environmentmaps if any
+            optimizer_.rollback();
             delete code_;
             code_ = nullptr;
             while (envMap_->parent() != nullptr)
                 unrollEnvironmentMap();
+            envMap_->rollback();
             throw;
         }
     }
-    void Compiler::enterNewEnv(Value names) {
-        envMap_ = new EnvironmentMap(envMap_);
+    void Compiler::enterNewEnv(Value names, EnvironmentMap::Kind kind) {
+        envMap_ = new EnvironmentMap(envMap_, kind);
         while (names != Nil) {
             Value arg = names.car();
             names = names.cdr();
@@ -149,12 +320,18 @@ namespace secd {
         code_ = new Code(code_);
     }
     
-    void Compiler::unrollAndAppendCode() {
+    Value Compiler::unrollCode() {
         Code * c = code_;
         code_ = c->parent();
-        code_->add(*c);
+        Value result = *c;
         c->detach();
         delete c;
+        return result;
+    }
+
+    void Compiler::unrollAndAppendCode() {
+        Value c = unrollCode();
+        code_->add(c);
     }
 
     /** Integer constant is compiled to the LDC instruction followed by the integer value itself.
@@ -175,12 +352,46 @@ namespace secd {
         code_->add(T);
     }
     
+    /** Global variables are loaded by LDG, variables of the letrec frames captured by the closure by LDB and all others by LD.
+     */
     void Compiler::compileVariableRead(Value const & code) {
-        code_->add(Instruction::LD);
-        code_->add(envMap_->indexOf(code));
+        Variable v = envMap_->lookup(code);
+        switch (v.kind) {
+        case Variable::Kind::Global:
+            code_->add(Instruction::LDG);
+            code_->add(Value::Integer(v.offset));
+            break;
+        case Variable::Kind::Local:
+        case Variable::Kind::Letrec:
+            code_->add(Instruction::LD);
+            code_->add(Value::Integer(Instruction::Address(v.depth, v.offset)));
+            break;
+        case Variable::Kind::Boxed:
+            code_->add(Instruction::LDB);
+            code_->add(Value::Integer(Instruction::Address(v.depth, v.offset)));
+            code_->add(Value::Integer(v.slot));
+            break;
+        }
+    }
+
+    void Compiler::compileCapture(Variable const & variable) {
+        switch (variable.kind) {
+        case Variable::Kind::Local:
+        case Variable::Kind::Boxed:
+            // a boxed variable is captured as the letrec frame itself, which is the captured variable of the enclosing function
+            code_->add(Instruction::LD);
+            code_->add(Value::Integer(Instruction::Address(variable.depth, variable.offset)));
+            break;
+        case Variable::Kind::Letrec:
+            code_->add(Instruction::LDE);
+            code_->add(Value::Integer(variable.depth));
+            break;
+        default:
+            assert(false && "Global variables are not captured");
+        }
     }
 
-    void Compiler::compileCall(Value const & code) {
+    void Compiler::compileCall(Value const & code, bool tail) {
         Value fname = code.car();
         Value args = code.cdr();
         if (fname.isSymbol()) {
@@ -212,30 +423,32 @@ namespace secd {
             else if (fname == Symbol::Read)
                 compileRead(args);
             else if (fname == Symbol::If)
-                compileIf(args);
+                compileIf(args, tail);
             else if (fname == Symbol::Lambda)
                 compileLambda(args);
             else if (fname == Symbol::Quote)
                 compileQuote(args);
             else if (fname == Symbol::Apply)
-                compileApply(args);
+                compileApply(args, tail);
             else if (fname == Symbol::Defun)
                 compileDefun(args);
             else if (fname == Symbol::Let)
-                compileLet(args);
+                compileLet(args, tail);
             else if (fname == Symbol::Letrec)
-                compileLetrec(args);
+                compileLetrec(args, tail);
             else if (fname == Symbol::Progn)
-                compileProgn(args);
+                compileProgn(args, tail);
             else {
-                compileFunctionArgs(args);
+                size_t n = compileFunctionArgs(args);
                 compile(fname);
-                code_->add(Instruction::AP);
+                code_->add(tail ? Instruction::TAPN : Instruction::APN);
+                code_->add(Value::Integer(n));
             }
         } else {
-            compileFunctionArgs(args);
+            size_t n = compileFunctionArgs(args);
             compile(fname);
-            code_->add(Instruction::AP);
+            code_->add(tail ? Instruction::TAPN : Instruction::APN);
+            code_->add(Value::Integer(n));
         }
     }
     
@@ -261,23 +474,47 @@ namespace secd {
         code_->add(Instruction::READ);
     }
 
-    void Compiler::compileIf(Value args) {
-        compile(car(args));
+    /** Both branches of a conditional in tail position are in tail position as well.
+     */
+    void Compiler::compileIf(Value args, bool tail) {
+        code_->add(compileCondition(car(args)));
         args = cdr(args);
-        code_->add(Instruction::SEL);
         enterNewCode();
-        compile(car(args));
+        compile(car(args), tail);
         args = cdr(args);
         code_->add(Instruction::JOIN);
         unrollAndAppendCode();
         enterNewCode();
-        compile(car(args));
+        compile(car(args), tail);
         code_->add(Instruction::JOIN);
         unrollAndAppendCode();
         if (cdr(args) != Nil)
             throw std::runtime_error("Too many arguments to if");
     }
 
+    /** Compiles the condition of a conditional and returns the instruction which branches on it. Comparisons leave only their operands on the stack for the fused branch instructions, a comparison with nil leaves the other operand.
+     */
+    int Compiler::compileCondition(Value const & condition) {
+        if (condition.isCons() && condition.cdr().isCons() && condition.cdr().cdr().isCons() && condition.cdr().cdr().cdr() == Nil) {
+            Value fname = condition.car();
+            Value lhs = condition.cdr().car();
+            Value rhs = condition.cdr().cdr().car();
+            if (fname == Symbol::Eq && (lhs == Nil || rhs == Nil)) {
+                compile(lhs == Nil ? rhs : lhs);
+                return Instruction::BNIL;
+            }
+            int opcode = fname == Symbol::Lt ? Instruction::BLT : fname == Symbol::Gt ? Instruction::BGT : fname == Symbol::Eq ? Instruction::BEQ : Instruction::SEL;
+            if (opcode != Instruction::SEL) {
+                // the operands are compiled as by compileBinaryOperator
+                compile(rhs);
+                compile(lhs);
+                return opcode;
+            }
+        }
+        compile(condition);
+        return Instruction::SEL;
+    }
+
     void Compiler::compileLambda(Value args) {
         Value argNames;
         Value body;
@@ -285,18 +522,24 @@ namespace secd {
         compileLambda(argNames, body);
     }
 
+    /** The variables captured by the function are only known once its body is compiled. They are loaded on the stack before the LDF instruction, which takes their number and the body.
+     */
     void Compiler::compileLambda(Value argNames, Value body) {
-        code_->add(Instruction::LDF);
         enterNewCode();
         // create new environment map for the function
-        enterNewEnv(argNames);
-        // compile the function
-        compile(body);
+        enterNewEnv(argNames, EnvironmentMap::Kind::Function);
+        // compile the function, whose body is in tail position
+        compile(body, true);
         code_->add(Instruction::RTN);
-        // restore the output code list and append the callee's code
-        unrollAndAppendCode();
-        // delete the callee's environment map
+        // restore the output code list and delete the callee's environment map
+        Value code = unrollCode();
+        std::vector<Variable> captures = envMap_->captures();
         unrollEnvironmentMap();
+        for (Variable const & v : captures)
+            compileCapture(v);
+        code_->add(Instruction::LDF);
+        code_->add(Value::Integer(captures.size()));
+        code_->add(code);
     }
 
     /** Quote simply loads its argument as value, i.e. compiles to LDC.
@@ -310,60 +553,68 @@ namespace secd {
             throw std::runtime_error("Too many arguments to quote");
     }
     
-    void Compiler::compileApply(Value args) {
+    void Compiler::compileApply(Value args, bool tail) {
         // TODO make nice error messages and check that args is valid length
         Value func = car(args);
         args = cdr(args);
         if (cdr(args) != Nil)
             throw std::runtime_error("Too many arguments to apply");
-        std::cout << args << std::endl;
-        // compile the actual call
-        compileFunctionArgs(args);
+        // the argument list is the value of the second argument itself
+        compile(car(args));
         // compile the function
         compile(func);
-        // arguments compiled, emit the AP instruction
-        code_->add(Instruction::AP);
+        // the argument list is only known at runtime, so AP takes it as a list
+        code_->add(tail ? Instruction::TAP : Instruction::AP);
     }
     
-    void Compiler::compileLet(Value args) {
+    void Compiler::compileLet(Value args, bool tail) {
         Value argNames;
         Value values;
         Value body;
         List::Expand(args, argNames, values, body);
-        compileFunctionArgs(values);
+        size_t n = compileFunctionArgs(values);
         compileLambda(argNames, body);
-        code_->add(Instruction::AP);
+        code_->add(tail ? Instruction::TAPN : Instruction::APN);
+        code_->add(Value::Integer(n));
     }
     
-    void Compiler::compileLetrec(Value args) {
+    void Compiler::compileLetrec(Value args, bool tail) {
         code_->add(Instruction::DUM);
         Value argNames;
         Value values;
         Value body;
         List::Expand(args, argNames, values, body);
-        enterNewEnv(argNames);
-        compileFunctionArgs(values);
+        // the values are compiled in the environment of the letrec variables
+        enterNewEnv(argNames, EnvironmentMap::Kind::Letrec);
+        size_t n = compileFunctionArgs(values);
+        // the body is created in the dummy environment too, but it has the variables as its arguments, as the dummy frame becomes its arguments frame at runtime
         compileLambda(argNames, body);
-        // arguments compiled, emit the AP instruction
-        code_->add(Instruction::RAP);
         unrollEnvironmentMap();
+        // arguments compiled, emit the RAPN instruction
+        code_->add(tail ? Instruction::TRAPN : Instruction::RAPN);
+        code_->add(Value::Integer(n));
     }
 
-    void Compiler::compileProgn(Value args) {
+    /** Only the last expression of a progn can be in tail position.
+     */
+    void Compiler::compileProgn(Value args, bool tail) {
         if (args == Nil) {
             code_->add(Instruction::NIL);
         } else {
             while (true) {
-                compile(args.car());
+                Value x = args.car();
                 args = cdr(args);
-                if (args == Nil)
+                if (args == Nil) {
+                    compile(x, tail);
                     break;
+                }
+                compile(x);
                 code_->add(Instruction::POP);
             }
         }
     }
     
-    /** Defun has its own bytecode.
+    /** Defun has its own bytecode, whose operand is the global slot of the function.
      */
     void Compiler::compileDefun(Value args) {
         if (code_->parent() != nullptr)
@@ -371,27 +622,24 @@ namespace secd {
         Value fname = car(args);
         if (! fname.isSymbol())
             throw std::runtime_error(STR("Name of the function expected, but " << args << " found"));
-        envMap_->addSymbol(fname);
+        int64_t slot = envMap_->global()->addSymbol(fname);
         args = cdr(args);
         compileLambda(args);
         code_->add(Instruction::DEFUN);
+        code_->add(Value::Integer(slot));
     }
     
-    void Compiler::compileCallArguments(Value args) {
+    /** Compiles the arguments from the last one and returns their number. The arguments are left on the stack for the call instruction, the first one on top.
+     */
+    size_t Compiler::compileFunctionArgs(Value const & args) {
         if (args == Nil)
-            return;
-        compileCallArguments(cdr(args));
+            return 0;
+        size_t result = compileFunctionArgs(cdr(args)) + 1;
         compile(car(args));
-        code_->add(Instruction::CONS);
-    }
-    
-    void Compiler::compileFunctionArgs(Value const & args) {
-        // now compile the arguments
-        code_->add(Instruction::NIL);
-        compileCallArguments(args);
+        return result;
     }
 
-    void Compiler::compile(Value const & code) {
+    void Compiler::compile(Value const & code, bool tail) {
         switch (code.kind()) {
         case GC::CellKind::Integer:
             compileInteger(code);
@@ -405,231 +653,768 @@ namespace secd {
                 compileVariableRead(code);
             break;
         case GC::CellKind::Cons:
-            compileCall(code);
+            compileCall(code, tail);
             break;
         default:
             assert(false && "Not aware of any other values to compile");
         }
     }
 
-#ifdef HAHA
-    
-    Value Runtime::run(Value const & code) {
-        try {
-            assert(c_.empty() && "Control register should be empty before executing new code");
-            c_ = code;
-            Value lhs(Nil);
-            Value rhs(Nil);
-            Value fun(Nil);
-            while (! c_.empty()) {
-                int64_t opcode = c_.pop().valueInt();
-                switch (opcode) {
-                    /* Simply pushes Nil on the stack.
-                        */
-                case Instruction::NIL:
-                    s_.push(Nil);
-                    break;
-                    /* Pushes the argument of the instruction directly on the stack.
-                        */
-                case Instruction::LDC:
-                    s_.push(c_.pop());
-                    break;
-                case Instruction::LD:
-                    s_.push(e_.locate(c_.pop()));
-                    break;
-                    /* Pops the value in s_ and based on its value selects either its first or second argument. The rest of the c register is pushed on the dump.
-                        */
-                case Instruction::SEL: {
-                    Value cond = s_.pop();
-                    Value trueCase = c_.pop();
-                    Value falseCase = c_.pop();
-                    d_.push(c_);
-                    if (toBoolean(cond))
-                        c_ = trueCase;
-                    else
-                        c_ = falseCase;
-                    break;
-                }
-                    /* Pops the backup of the control register from the dump and restores its value.
-                        */
-                case Instruction::JOIN:
-                    c_ = d_.pop();
-                    break;
-                    /* Packages the current environment and the code for a function (as argument on the control stack) and pushes it on the S stack.
-                        */
-                case Instruction::LDF: {
-                    Value body = c_.pop();
-                    s_.push(Value::Closure(body, e_));
-                    break;
-                }
-                    /* The S register contains a closure and a list of arguments given to it.
-                        */
-                case Instruction::AP: {
-                    // get the argument list and the closure from the S register
-                    Value closure = s_.pop();
-                    if (! closure.isClosure())
-                        throw std::runtime_error(STR("AP expects closure on stack, but " << closure << " found"));
-                    Value argList = s_.pop();
-                    // backup the values of S, E and C registers to the dump
-                    d_.push(List({s_, e_, c_}));
-                    s_ = Nil;
-                    e_ = Value::Cons(argList, closure.environment());
-                    c_ = closure.body();
-                    break;
-                }
-                    /* Gets the result value from the S register, then recovers the S E and C registers of the caller function from the D register and pushes the result on the caller's S register.
-                        */
-                case Instruction::RTN: {
-                    // get the result
-                    Value result = s_.pop();
-                    // pop the caller's context from the D register, expand and restore the S E C registers
-                    Value callerContext(d_.pop());
-                    s_ = callerContext.car();
-                    callerContext = callerContext.cdr();
-                    e_ = callerContext.car();
-                    callerContext = callerContext.cdr();
-                    c_ = callerContext.car();
-                    // push the result to the caller's stack now
-                    s_.push(result);
-                    break;
-                }
-                    /* Inserts a dummy environment in the environment chain.
-                        */
-                case Instruction::DUM: {
-                    e_.insertDummyEnvironment();
-                    break;
-                }
-                    /* Recursive apply is perhaps the hardest, and is the only instruction that actually has to do in-place change. 
-                        */
-                case Instruction::RAP: {
-                    // pop the dummy environment from the current env list since it is no longer needed
-                    e_.popDummyEnvironment();
-                    // get the argument list and the closure from the S register
-                    Value closure = s_.pop();
-                    Value argList = s_.pop();
-                    // get the closure environment and patch its car, which is the dummy Nil env from DUM
-                    Value closureEnv = closure.environment();
-                    assert(closureEnv.car() == Nil && "Expected dummy env from DUM");
-                    closureEnv.setCar(argList);
-                    // backup the values of S, E and C registers to the dump
-                    d_.push(List({s_, e_, c_}));
-                    // prepare stuff for the application
-                    s_ = Nil;
-                    e_ = closureEnv;
-                    c_ = closure.body();
-                    break;
-                }
-                    /* Defines a function in the global environment. This is not part of the original SECD machine, but has been added so that we can use the interpreter in a REPL mode.
-                        */
-                case Instruction::DEFUN: {
-                    fun = s_.pop();
-                    e_.append(fun);
-                    s_.push(Nil);
-                    break;
-                }
-                /* Pops from the s_ stack. This enables sequence programming.
-                    */
-                case Instruction::POP: {
-                    s_.pop();
-                    break;
-                }
-                    /* Pops two values from S register, creates a cons cell from them and pushes it back on the S stack.
-                        */
-                case Instruction::CONS: {
-                    lhs = s_.pop();
-                    rhs = s_.pop();
-                    s_.push(Value::Cons(lhs, rhs));
-                    break;
-                }
-                    /* Pops value from the S register and pushes on it its car value.
-                        */
-                case Instruction::CAR:
-                    s_.push(car(s_.pop()));
-                    break;
-                    /* Pops value from the S register and pushes on it its cdr value.
-                        */
-                case Instruction::CDR:
-                    s_.push(cdr(s_.pop()));
-                    break;
-                case Instruction::CONSP:
-                    if (cdr(s_.pop()).isCons())
-                        s_.push(T);
-                    else
-                        s_.push(Nil);
-                    break;
-                case Instruction::ADD: {
-                    lhs = s_.pop();
-                    rhs = s_.pop();
-                    s_.push(Value::Integer(lhs.valueInt() + rhs.valueInt()));
-                    break;
-                }
-                case Instruction::SUB: {
-                    lhs = s_.pop();
-                    rhs = s_.pop();
-                    s_.push(Value::Integer(lhs.valueInt() - rhs.valueInt()));
-                    break;
-                }
-                case Instruction::MUL: {
-                    lhs = s_.pop();
-                    rhs = s_.pop();
-                    s_.push(Value::Integer(lhs.valueInt() * rhs.valueInt()));
-                    break;
-                }
-                case Instruction::DIV: {
-                    lhs = s_.pop();
-                    rhs = s_.pop();
-                    s_.push(Value::Integer(lhs.valueInt() / rhs.valueInt()));
-                    break;
-                }
-                case Instruction::EQ: {
-                    lhs = s_.pop();
-                    rhs = s_.pop();
-                    int64_t result = 0;
-                    if (lhs.isInteger() && rhs.isInteger())
-                        result = lhs.valueInt() == rhs.valueInt();
-                    else
-                        result = lhs == rhs;
-                    s_.push(Value::Integer(result));
-                    break;
-                }
-                case Instruction::LT: {
-                    lhs = s_.pop();
-                    rhs = s_.pop();
-                    s_.push(Value::Integer(lhs.valueInt() < rhs.valueInt()));
-                    break;
-                }
-                case Instruction::GT: {
-                    lhs = s_.pop();
-                    rhs = s_.pop();
-                    s_.push(Value::Integer(lhs.valueInt() > rhs.valueInt()));
-                    break;
-                }
-                case Instruction::PRINT: {
-                    lhs = s_.top();
-                    print(lhs);
-                    break;
-                }
-                case Instruction::READ: {
-                    s_.push(read());
-                    break;
-                }
-                default:
-                    assert(false && "Unexpected opcode");
-                }
-            }
-            assert(! s_.empty() && "Malformed program");
-            Value result = s_.pop();
-            assert(s_.empty() && "Malformed program");
+    namespace {
+
+        void checkIntegers(ValueRef lhs, ValueRef rhs, char const * instruction) {
+            if (! lhs.isInteger() || ! rhs.isInteger())
+                throw std::runtime_error(STR(instruction << " expects integers, but " << lhs << " and " << rhs << " found"));
+        }
+
+        size_t length(ValueRef list) {
+            size_t result = 0;
+            for (; list.isCons(); list = list.cdr())
+                ++result;
             return result;
+        }
+
+        /** Stores the arguments from the list to the slots of the frame.
+         */
+        void fillFrame(Value & frame, ValueRef args) {
+            for (size_t i = 0; args.isCons(); args = args.cdr())
+                frame.setSlot(i++, args.car());
+        }
+
+        /** Returns the result of eq for the given values.
+         */
+        bool equal(ValueRef lhs, ValueRef rhs) {
+            if (lhs.isInteger() && rhs.isInteger())
+                return lhs.valueInt() == rhs.valueInt();
+            return lhs == rhs;
+        }
+
+        /** Pops the operands of a comparison from the stack and returns its result. The operands are integers, unless the comparison is eq.
+         */
+        template<int OPCODE>
+        bool compare(ValueStack & s) {
+            ValueRef lhs = s.top();
+            ValueRef rhs = s[s.size() - 2];
+            s.truncate(s.size() - 2);
+            if (OPCODE == Instruction::BEQ)
+                return equal(lhs, rhs);
+            checkIntegers(lhs, rhs, OPCODE == Instruction::BLT ? "LT" : "GT");
+            return OPCODE == Instruction::BLT ? lhs.valueInt() < rhs.valueInt() : lhs.valueInt() > rhs.valueInt();
+        }
+
+        /** Returns true if both operands of a binary operator are immediate integers.
+         */
+        bool immediateOperands(ValueStack const & s) {
+            return s.top().isImmediate() && s[s.size() - 2].isImmediate();
+        }
+
+        /** Returns true if any operand of a binary operator is a symbol, in which case eq is the identity.
+         */
+        bool symbolOperand(ValueStack const & s) {
+            return s.top().isSymbol() || s[s.size() - 2].isSymbol();
+        }
+
+        /** Replaces the operands of an integer operator on the stack by its result, but only if both operands and the result are immediate integers. Returns false and leaves the stack as it is otherwise.
+         */
+        template<typename OPERATOR>
+        bool immediateOperator(ValueStack & s, OPERATOR op) {
+            ValueRef lhs = s.top();
+            ValueRef rhs = s[s.size() - 2];
+            if (! lhs.isImmediate() || ! rhs.isImmediate())
+                return false;
+            // the operands have 63 bits at most, so neither addition nor subtraction overflows
+            int64_t result = op(lhs.valueInt(), rhs.valueInt());
+            if (! GC::FitsImmediate(result))
+                return false;
+            s.truncate(s.size() - 1);
+            s.setTop(ValueRef::Immediate(result));
+            return true;
+        }
+
+        /** Replaces the operands of eq on the stack by the result of comparing their identity.
+         */
+        void identity(ValueStack & s) {
+            bool result = s.top() == s[s.size() - 2];
+            s.truncate(s.size() - 1);
+            s.setTop(ValueRef::Immediate(result));
+        }
+
+        /** Moves the given number of arguments from the stack to the slots of the frame, the top one being the first.
+         */
+        void popArguments(ValueStack & s, Value & frame, size_t n) {
+            size_t top = s.size() - 1;
+            for (size_t i = 0; i < n; ++i)
+                frame.setSlot(i, s[top - i]);
+            s.truncate(s.size() - n);
+        }
+
+    } // anonymous namespace
+
+#if defined(__GNUC__) && ! defined(SECD_SWITCH_DISPATCH)
+#define SECD_COMPUTED_GOTO
+#endif
+
+    /* Each handler advances the program counter and ends with DISPATCH. Handlers that need locals keep them in a block that ends before DISPATCH so that they are destroyed before the jump.
+     */
+#ifdef SECD_PROFILE_OPCODES
+#define PROFILE() profile_.record(code[pc])
+#else
+#define PROFILE()
+#endif
+
+#ifdef SECD_COMPUTED_GOTO
+#define HANDLER(NAME) NAME
+#define DISPATCH() ++count; PROFILE(); goto * dispatch[code[pc]]
+#define REDISPATCH() goto * dispatch[code[pc]]
+#else
+#define HANDLER(NAME) case Instruction::NAME
+#define DISPATCH() ++count; continue
+#define REDISPATCH() continue
+#endif
+
+    /* A generic handler quickens itself before it executes the instruction, the quickened form is used from the next execution on. A quickened handler whose operands do not match deoptimizes, i.e. rewrites the instruction back to the generic form and executes it again without counting it twice.
+     */
+#ifdef SECD_NO_QUICKENING
+#define QUICKEN(NAME)
+#else
+#define QUICKEN(NAME) bytecode_.rewrite(pc, Instruction::NAME)
+#endif
+#define DEOPTIMIZE(NAME) { bytecode_.rewrite(pc, Instruction::NAME); REDISPATCH(); }
+
+    /* Calls and returns continue in the native code if the code they continue with has been compiled by the JIT, which returns the offset at which the interpreter takes over again.
+     */
+#define NATIVE(CODE) if (void * native = CODE) pc = jit_.run(native, count)
+
+    Value Interpreter::run(Value const & code) {
+        size_t entry = bytecode_.lower(code);
+        jit_.resize(bytecode_.size());
+        e_.reserveGlobals(compiler_.globals());
+        size_t region = GC::RegionTop();
+        try {
+            return execute(entry);
         } catch (...) {
             // if there is an error, make sure the leave th SECD machine in proper-ish state
-            c_ = Nil;
-            s_ = Nil;
-            d_ = Nil;
-            while (cdr(e_) != Nil)
-                e_ = cdr(e_);
+            s_.clear();
+            d_.clear();
+            e_.unwind();
+            GC::PopRegion(region);
             throw;
         }
     }
+
+    /* The arguments frames of the calls are created in the frame region of the GC. Closures capture the values of the variables and not the frames, the only frames they capture are those of letrec, which DUM creates in the heap. No heap cell therefore points to an arguments frame once its call has returned, and the frame is popped by RTN. A tail call pops the frame of the caller first, so that loops do not grow the region.
+     */
+    inline size_t Interpreter::call(Value const & closure, size_t args, size_t returnAddress, char const * instruction) {
+        if (! closure.isClosure())
+            throw std::runtime_error(STR(instruction << " expects closure on stack, but " << closure << " found"));
+        if (returnAddress == 0)
+            e_.release();
+        size_t region = GC::RegionTop();
+        Value frame = Value::RegionFrame(args, closure.environment());
+        popArguments(s_, frame, args);
+        return enter(closure, frame, returnAddress, region);
+    }
+
+    inline size_t Interpreter::apply(Value const & closure, size_t returnAddress, char const * instruction) {
+        if (! closure.isClosure())
+            throw std::runtime_error(STR(instruction << " expects closure on stack, but " << closure << " found"));
+        if (returnAddress == 0)
+            e_.release();
+        size_t region = GC::RegionTop();
+        Value argList = s_.pop();
+        Value frame = Value::RegionFrame(length(argList), closure.environment());
+        fillFrame(frame, argList);
+        return enter(closure, frame, returnAddress, region);
+    }
+
+    inline size_t Interpreter::callRecursive(Value const & closure, size_t args, size_t returnAddress, char const * instruction) {
+        if (! closure.isClosure())
+            throw std::runtime_error(STR(instruction << " expects closure on stack, but " << closure << " found"));
+        // the dummy frame from DUM becomes the arguments frame of the body, the closures created by the values see its slots once they are filled in
+        Value frame = e_.popDummyEnvironment();
+        frame.resizeFrame(args);
+        popArguments(s_, frame, args);
+        frame.setParent(closure.environment());
+        // the frame of the function the letrec is in dies in a tail call, the dummy frame no longer points to it
+        if (returnAddress == 0)
+            e_.release();
+        return enter(closure, frame, returnAddress, GC::RegionTop());
+    }
+
+    inline size_t Interpreter::enter(Value const & closure, Value const & frame, size_t returnAddress, size_t region) {
+        if (returnAddress != 0) {
+            // backup the top of the frame region, the height of S, E and the return address to the dump
+            d_.push(Value::Integer(region));
+            d_.push(Value::Integer(s_.size()));
+            d_.push(e_);
+            d_.push(Value::Integer(returnAddress));
+        }
+        e_ = frame;
+        return closure.body().valueInt();
+    }
+
+    inline size_t Interpreter::leave() {
+        Value result = s_.pop();
+        size_t pc = d_.top().valueInt();
+        d_.truncate(d_.size() - 1);
+        e_ = d_.pop();
+        s_.truncate(d_.top().valueInt());
+        d_.truncate(d_.size() - 1);
+        GC::PopRegion(d_.top().valueInt());
+        d_.truncate(d_.size() - 1);
+        s_.push(result);
+        return pc;
+    }
+
+    /* The runtime calls catch all errors, as they must not unwind through the native code.
+     */
+    void * Interpreter::NativeCall(Interpreter & self, size_t args, size_t returnAddress) {
+        try {
+            Value closure = self.s_.pop();
+            size_t pc = self.call(closure, args, returnAddress, returnAddress == 0 ? "TAPN" : "APN");
+            return self.jit_.jump(self.jit_.enter(pc), pc);
+        } catch (...) {
+            return self.jit_.fail(std::current_exception());
+        }
+    }
+
+    void * Interpreter::NativeCallGlobal(Interpreter & self, size_t offset, size_t args, size_t returnAddress) {
+        try {
+            Value closure = self.e_.global(offset);
+            size_t pc = self.call(closure, args, returnAddress, returnAddress == 0 ? "TAPN" : "APN");
+            return self.jit_.jump(self.jit_.enter(pc), pc);
+        } catch (...) {
+            return self.jit_.fail(std::current_exception());
+        }
+    }
+
+    void * Interpreter::NativeApply(Interpreter & self, size_t returnAddress) {
+        try {
+            Value closure = self.s_.pop();
+            size_t pc = self.apply(closure, returnAddress, returnAddress == 0 ? "TAP" : "AP");
+            return self.jit_.jump(self.jit_.enter(pc), pc);
+        } catch (...) {
+            return self.jit_.fail(std::current_exception());
+        }
+    }
+
+    void * Interpreter::NativeCallRecursive(Interpreter & self, size_t args, size_t returnAddress) {
+        try {
+            Value closure = self.s_.pop();
+            size_t pc = self.callRecursive(closure, args, returnAddress, returnAddress == 0 ? "TRAPN" : "RAPN");
+            return self.jit_.jump(self.jit_.enter(pc), pc);
+        } catch (...) {
+            return self.jit_.fail(std::current_exception());
+        }
+    }
+
+    void * Interpreter::NativeReturn(Interpreter & self) {
+        try {
+            size_t pc = self.leave();
+            return self.jit_.jump(self.jit_.resume(pc), pc);
+        } catch (...) {
+            return self.jit_.fail(std::current_exception());
+        }
+    }
+
+    bool Interpreter::NativeClosure(Interpreter & self, size_t captures, size_t entry) {
+        try {
+            Value environment = Nil;
+            if (captures != 0) {
+                environment = Value::Frame(captures, Nil);
+                size_t first = self.s_.size() - captures;
+                for (size_t i = 0; i < captures; ++i)
+                    environment.setSlot(i, self.s_[first + i]);
+                self.s_.truncate(first);
+            }
+            self.s_.push(Value::Closure(Value::Integer(entry), environment));
+            return true;
+        } catch (...) {
+            self.jit_.fail(std::current_exception());
+            return false;
+        }
+    }
+
+    bool Interpreter::NativeCons(Interpreter & self) {
+        try {
+            Value lhs = self.s_.pop();
+            Value rhs = self.s_.pop();
+            self.s_.push(Value::Cons(lhs, rhs));
+            return true;
+        } catch (...) {
+            self.jit_.fail(std::current_exception());
+            return false;
+        }
+    }
+
+    bool Interpreter::NativeDummy(Interpreter & self) {
+        try {
+            self.e_.insertDummyEnvironment();
+            return true;
+        } catch (...) {
+            self.jit_.fail(std::current_exception());
+            return false;
+        }
+    }
+
+    bool Interpreter::NativeReserve(Interpreter & self, size_t values) {
+        try {
+            self.s_.reserve(values);
+            return true;
+        } catch (...) {
+            self.jit_.fail(std::current_exception());
+            return false;
+        }
+    }
+
+    Value Interpreter::execute(size_t pc) {
+        // no code is lowered while running and quickening rewrites the opcodes in place, so the pointer stays valid
+        uint32_t const * code = bytecode_.code();
+        size_t count = 0;
+        Value lhs;
+        Value rhs;
+#ifdef SECD_COMPUTED_GOTO
+        // must be in the order of the opcodes
+        static void * const dispatch[] = {
+            && NIL, && LDC, && LD, && SEL, && JOIN, && LDF, && AP, && RTN, && DUM, && RAPN, && DEFUN, && POP, && STOP,
+            && CONS, && CAR, && CDR, && CONSP,
+            && ADD, && SUB, && MUL, && DIV, && EQ, && LT, && GT,
+            && PRINT, && READ,
+            && LD0, && LD1,
+            && TAP, && TRAPN,
+            && APN, && TAPN,
+            && BLT, && BGT, && BEQ, && BNIL,
+            && LDC_LD0_ADD, && LDC_LD0_SUB, && LDC_LD0_LT, && LDC_LD0_GT, && LDC_LD0_EQ, && LD0_LD0_ADD, && LDG_APN, && LDG_TAPN,
+            && LDC_LD0_BLT, && LDC_LD0_BGT, && LDC_LD0_BEQ,
+            && ADD_II, && SUB_II, && LT_II, && GT_II, && EQ_II, && EQ_SYM, && CAR_C, && CDR_C,
+            && LDG, && LDE, && LDB,
+        };
+        static_assert(sizeof(dispatch) / sizeof(dispatch[0]) == Instruction::COUNT, "Dispatch table does not match the opcodes");
+        PROFILE();
+        goto * dispatch[code[pc]];
+#else
+        while (true) {
+            assert(code[pc] < Instruction::COUNT && "Unexpected opcode");
+            PROFILE();
+            switch (code[pc]) {
 #endif
-}
+            /* Simply pushes Nil on the stack.
+             */
+            HANDLER(NIL):
+                s_.push(Nil);
+                pc += 1;
+                DISPATCH();
+            /* Pushes the constant given by the argument of the instruction on the stack.
+             */
+            HANDLER(LDC):
+                s_.push(bytecode_.constant(code[pc + 1]));
+                pc += 2;
+                DISPATCH();
+            /* Pushes the variable at the given depth and offset of the environment on the stack.
+             */
+            HANDLER(LD):
+                s_.push(e_.locate(code[pc + 1], code[pc + 2]));
+                pc += 3;
+                DISPATCH();
+            /* Variables of the current and the parent frame, which are the most common, do not need to walk the environment chain.
+             */
+            HANDLER(LD0):
+                s_.push(e_.local(code[pc + 1]));
+                pc += 2;
+                DISPATCH();
+            HANDLER(LD1):
+                s_.push(e_.parent(code[pc + 1]));
+                pc += 2;
+                DISPATCH();
+            HANDLER(LDG):
+                s_.push(e_.global(code[pc + 1]));
+                pc += 2;
+                DISPATCH();
+            HANDLER(LDE):
+                s_.push(e_.frame(code[pc + 1]));
+                pc += 2;
+                DISPATCH();
+            HANDLER(LDB):
+                s_.push(e_.locate(code[pc + 1], code[pc + 2]).slot(code[pc + 3]));
+                pc += 4;
+                DISPATCH();
+            /* Pops the value in s_ and based on its value either continues with the true branch which follows, or jumps to the false branch.
+             */
+            HANDLER(SEL):
+                lhs = s_.pop();
+                pc += toBoolean(lhs) ? 2 : code[pc + 1];
+                DISPATCH();
+            /* Compares the values on the stack and continues with the true branch, or jumps to the false branch as SEL does. Popping the operands before the comparison is safe as no allocation happens in between.
+             */
+            HANDLER(BLT):
+                pc += compare<Instruction::BLT>(s_) ? 2 : code[pc + 1];
+                DISPATCH();
+            HANDLER(BGT):
+                pc += compare<Instruction::BGT>(s_) ? 2 : code[pc + 1];
+                DISPATCH();
+            HANDLER(BEQ):
+                pc += compare<Instruction::BEQ>(s_) ? 2 : code[pc + 1];
+                DISPATCH();
+            HANDLER(BNIL):
+                pc += s_.top() == Nil ? 2 : code[pc + 1];
+                s_.truncate(s_.size() - 1);
+                DISPATCH();
+            /* Jumps past the conditional.
+             */
+            HANDLER(JOIN):
+                pc += code[pc + 1];
+                DISPATCH();
+            /* Moves the captured variables from the stack to a new frame, packages it with the entry offset of the function and pushes the closure on the S stack. A closure which captures nothing has no frame.
+             */
+            HANDLER(LDF): {
+                    size_t n = code[pc + 1];
+                    Value environment = Nil;
+                    if (n != 0) {
+                        environment = Value::Frame(n, Nil);
+                        // the captured variables are on the stack in the order of their slots
+                        size_t first = s_.size() - n;
+                        for (size_t i = 0; i < n; ++i)
+                            environment.setSlot(i, s_[first + i]);
+                        s_.truncate(first);
+                    }
+                    s_.push(Value::Closure(Value::Integer(code[pc + 2]), environment));
+                    pc += 3;
+                }
+                DISPATCH();
+            /* The S register contains a closure and a list of arguments given to it.
+             */
+            HANDLER(AP):
+                lhs = s_.pop();
+                pc = apply(lhs, pc + 1, "AP");
+                NATIVE(jit_.enter(pc));
+                DISPATCH();
+            /* Tail call, which reuses the dump frame of the current function so that the callee returns directly to our caller. Nothing is left on the stack of a function in tail position but the closure and the arguments.
+             */
+            HANDLER(TAP):
+                lhs = s_.pop();
+                pc = apply(lhs, 0, "TAP");
+                NATIVE(jit_.enter(pc));
+                DISPATCH();
+            /* The S register contains a closure and below it the number of arguments given by the operand, the first argument being the topmost.
+             */
+            HANDLER(APN):
+                lhs = s_.pop();
+                pc = call(lhs, code[pc + 1], pc + 2, "APN");
+                NATIVE(jit_.enter(pc));
+                DISPATCH();
+            HANDLER(TAPN):
+                lhs = s_.pop();
+                pc = call(lhs, code[pc + 1], 0, "TAPN");
+                NATIVE(jit_.enter(pc));
+                DISPATCH();
+            /* Gets the result value from the S register, then recovers the S and E registers and the return address of the caller function from the D register and pushes the result on the caller's S register. The frames the call created in the frame region are popped.
+             */
+            HANDLER(RTN):
+                pc = leave();
+                NATIVE(jit_.resume(pc));
+                DISPATCH();
+            /* Inserts a dummy environment in the environment chain.
+             */
+            HANDLER(DUM):
+                e_.insertDummyEnvironment();
+                pc += 1;
+                DISPATCH();
+            /* Recursive apply is perhaps the hardest, and is the only instruction that actually has to do in-place change. The arguments are on the stack as for APN.
+             */
+            HANDLER(RAPN):
+                lhs = s_.pop();
+                pc = callRecursive(lhs, code[pc + 1], pc + 2, "RAPN");
+                NATIVE(jit_.enter(pc));
+                DISPATCH();
+            /* Recursive apply in tail position, the dump is left as it is.
+             */
+            HANDLER(TRAPN):
+                lhs = s_.pop();
+                pc = callRecursive(lhs, code[pc + 1], 0, "TRAPN");
+                NATIVE(jit_.enter(pc));
+                DISPATCH();
+            /* Defines a function in the global environment. This is not part of the original SECD machine, but has been added so that we can use the interpreter in a REPL mode.
+             */
+            HANDLER(DEFUN):
+                lhs = s_.pop();
+                e_.define(code[pc + 1], lhs);
+                s_.push(Nil);
+                pc += 2;
+                DISPATCH();
+            /* Pops from the s_ stack. This enables sequence programming.
+             */
+            HANDLER(POP):
+                s_.truncate(s_.size() - 1);
+                pc += 1;
+                DISPATCH();
+            HANDLER(STOP):
+                goto done;
+            /* Pops two values from S register, creates a cons cell from them and pushes it back on the S stack.
+             */
+            HANDLER(CONS):
+                lhs = s_.pop();
+                rhs = s_.pop();
+                s_.push(Value::Cons(lhs, rhs));
+                pc += 1;
+                DISPATCH();
+            HANDLER(CAR):
+                if (s_.top().isCons())
+                    QUICKEN(CAR_C);
+                s_.push(car(s_.pop()));
+                pc += 1;
+                DISPATCH();
+            HANDLER(CDR):
+                if (s_.top().isCons())
+                    QUICKEN(CDR_C);
+                s_.push(cdr(s_.pop()));
+                pc += 1;
+                DISPATCH();
+            /* Pushes T if the value is a cons and nil otherwise, for any value. The original runtime tested the cdr of the value instead, so that it threw for atoms and returned nil for lists of one element.
+             */
+            HANDLER(CONSP):
+                s_.push(s_.pop().isCons() ? T : Nil);
+                pc += 1;
+                DISPATCH();
+            HANDLER(ADD):
+                if (immediateOperands(s_))
+                    QUICKEN(ADD_II);
+                lhs = s_.pop();
+                rhs = s_.pop();
+                checkIntegers(lhs, rhs, "ADD");
+                s_.push(Value::Integer(lhs.valueInt() + rhs.valueInt()));
+                pc += 1;
+                DISPATCH();
+            HANDLER(SUB):
+                if (immediateOperands(s_))
+                    QUICKEN(SUB_II);
+                lhs = s_.pop();
+                rhs = s_.pop();
+                checkIntegers(lhs, rhs, "SUB");
+                s_.push(Value::Integer(lhs.valueInt() - rhs.valueInt()));
+                pc += 1;
+                DISPATCH();
+            HANDLER(MUL):
+                lhs = s_.pop();
+                rhs = s_.pop();
+                checkIntegers(lhs, rhs, "MUL");
+                // the product wraps around on overflow, as it does in the native code
+                s_.push(Value::Integer(static_cast<int64_t>(static_cast<uint64_t>(lhs.valueInt()) * static_cast<uint64_t>(rhs.valueInt()))));
+                pc += 1;
+                DISPATCH();
+            HANDLER(DIV):
+                lhs = s_.pop();
+                rhs = s_.pop();
+                checkIntegers(lhs, rhs, "DIV");
+                if (rhs.valueInt() == 0)
+                    throw std::runtime_error("Division by zero");
+                s_.push(Value::Integer(lhs.valueInt() / rhs.valueInt()));
+                pc += 1;
+                DISPATCH();
+            HANDLER(EQ):
+                if (immediateOperands(s_))
+                    QUICKEN(EQ_II);
+                else if (symbolOperand(s_))
+                    QUICKEN(EQ_SYM);
+                lhs = s_.pop();
+                rhs = s_.pop();
+                if (lhs.isInteger() && rhs.isInteger())
+                    s_.push(Value::Integer(lhs.valueInt() == rhs.valueInt()));
+                else
+                    s_.push(Value::Integer(lhs == rhs));
+                pc += 1;
+                DISPATCH();
+            HANDLER(LT):
+                if (immediateOperands(s_))
+                    QUICKEN(LT_II);
+                lhs = s_.pop();
+                rhs = s_.pop();
+                checkIntegers(lhs, rhs, "LT");
+                s_.push(Value::Integer(lhs.valueInt() < rhs.valueInt()));
+                pc += 1;
+                DISPATCH();
+            HANDLER(GT):
+                if (immediateOperands(s_))
+                    QUICKEN(GT_II);
+                lhs = s_.pop();
+                rhs = s_.pop();
+                checkIntegers(lhs, rhs, "GT");
+                s_.push(Value::Integer(lhs.valueInt() > rhs.valueInt()));
+                pc += 1;
+                DISPATCH();
+            HANDLER(PRINT):
+                lhs = s_.top();
+                print(lhs);
+                pc += 1;
+                DISPATCH();
+            HANDLER(READ):
+                s_.push(read());
+                pc += 1;
+                DISPATCH();
+            /* The superinstructions behave exactly as the sequences they replace, the local variable being the left operand.
+             */
+            HANDLER(LDC_LD0_ADD):
+                lhs = e_.local(code[pc + 2]);
+                rhs = bytecode_.constant(code[pc + 1]);
+                checkIntegers(lhs, rhs, "ADD");
+                s_.push(Value::Integer(lhs.valueInt() + rhs.valueInt()));
+                pc += 3;
+                DISPATCH();
+            HANDLER(LDC_LD0_SUB):
+                lhs = e_.local(code[pc + 2]);
+                rhs = bytecode_.constant(code[pc + 1]);
+                checkIntegers(lhs, rhs, "SUB");
+                s_.push(Value::Integer(lhs.valueInt() - rhs.valueInt()));
+                pc += 3;
+                DISPATCH();
+            HANDLER(LDC_LD0_LT):
+                lhs = e_.local(code[pc + 2]);
+                rhs = bytecode_.constant(code[pc + 1]);
+                checkIntegers(lhs, rhs, "LT");
+                s_.push(Value::Integer(lhs.valueInt() < rhs.valueInt()));
+                pc += 3;
+                DISPATCH();
+            HANDLER(LDC_LD0_GT):
+                lhs = e_.local(code[pc + 2]);
+                rhs = bytecode_.constant(code[pc + 1]);
+                checkIntegers(lhs, rhs, "GT");
+                s_.push(Value::Integer(lhs.valueInt() > rhs.valueInt()));
+                pc += 3;
+                DISPATCH();
+            HANDLER(LDC_LD0_EQ):
+                lhs = e_.local(code[pc + 2]);
+                rhs = bytecode_.constant(code[pc + 1]);
+                if (lhs.isInteger() && rhs.isInteger())
+                    s_.push(Value::Integer(lhs.valueInt() == rhs.valueInt()));
+                else
+                    s_.push(Value::Integer(lhs == rhs));
+                pc += 3;
+                DISPATCH();
+            HANDLER(LD0_LD0_ADD):
+                lhs = e_.local(code[pc + 2]);
+                rhs = e_.local(code[pc + 1]);
+                checkIntegers(lhs, rhs, "ADD");
+                s_.push(Value::Integer(lhs.valueInt() + rhs.valueInt()));
+                pc += 3;
+                DISPATCH();
+            HANDLER(LDC_LD0_BLT):
+                lhs = e_.local(code[pc + 2]);
+                rhs = bytecode_.constant(code[pc + 1]);
+                checkIntegers(lhs, rhs, "LT");
+                pc += lhs.valueInt() < rhs.valueInt() ? 4 : code[pc + 3];
+                DISPATCH();
+            HANDLER(LDC_LD0_BGT):
+                lhs = e_.local(code[pc + 2]);
+                rhs = bytecode_.constant(code[pc + 1]);
+                checkIntegers(lhs, rhs, "GT");
+                pc += lhs.valueInt() > rhs.valueInt() ? 4 : code[pc + 3];
+                DISPATCH();
+            HANDLER(LDC_LD0_BEQ):
+                lhs = e_.local(code[pc + 2]);
+                rhs = bytecode_.constant(code[pc + 1]);
+                pc += equal(lhs, rhs) ? 4 : code[pc + 3];
+                DISPATCH();
+            HANDLER(LDG_APN):
+                lhs = e_.global(code[pc + 1]);
+                pc = call(lhs, code[pc + 2], pc + 3, "APN");
+                NATIVE(jit_.enter(pc));
+                DISPATCH();
+            HANDLER(LDG_TAPN):
+                lhs = e_.global(code[pc + 1]);
+                pc = call(lhs, code[pc + 2], 0, "TAPN");
+                NATIVE(jit_.enter(pc));
+                DISPATCH();
+            /* The quickened handlers work on the stack slots directly, so that no values are rooted.
+             */
+            HANDLER(ADD_II):
+                if (! immediateOperator(s_, [](int64_t lhs, int64_t rhs) { return lhs + rhs; }))
+                    DEOPTIMIZE(ADD);
+                pc += 1;
+                DISPATCH();
+            HANDLER(SUB_II):
+                if (! immediateOperator(s_, [](int64_t lhs, int64_t rhs) { return lhs - rhs; }))
+                    DEOPTIMIZE(SUB);
+                pc += 1;
+                DISPATCH();
+            HANDLER(LT_II):
+                if (! immediateOperator(s_, [](int64_t lhs, int64_t rhs) -> int64_t { return lhs < rhs; }))
+                    DEOPTIMIZE(LT);
+                pc += 1;
+                DISPATCH();
+            HANDLER(GT_II):
+                if (! immediateOperator(s_, [](int64_t lhs, int64_t rhs) -> int64_t { return lhs > rhs; }))
+                    DEOPTIMIZE(GT);
+                pc += 1;
+                DISPATCH();
+            /* Immediate integers are equal iff their references are.
+             */
+            HANDLER(EQ_II):
+                if (! immediateOperands(s_))
+                    DEOPTIMIZE(EQ);
+                identity(s_);
+                pc += 1;
+                DISPATCH();
+            HANDLER(EQ_SYM):
+                if (! symbolOperand(s_))
+                    DEOPTIMIZE(EQ);
+                identity(s_);
+                pc += 1;
+                DISPATCH();
+            HANDLER(CAR_C):
+                if (! s_.top().isCons())
+                    DEOPTIMIZE(CAR);
+                s_.setTop(s_.top().car());
+                pc += 1;
+                DISPATCH();
+            HANDLER(CDR_C):
+                if (! s_.top().isCons())
+                    DEOPTIMIZE(CDR);
+                s_.setTop(s_.top().cdr());
+                pc += 1;
+                DISPATCH();
+#ifndef SECD_COMPUTED_GOTO
+            }
+        }
+#endif
+      done:
+        instructions_ += count;
+        profile_.interrupt();
+        assert(! s_.empty() && "Malformed program");
+        Value result = s_.pop();
+        assert(s_.empty() && "Malformed program");
+        return result;
+    }
+
+#undef HANDLER
+#undef DISPATCH
+#undef REDISPATCH
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef PROFILE
+#undef NATIVE
+
+    void OpcodeProfile::print(std::ostream & s, size_t top) const {
+        auto printTop = [&](std::vector<size_t> const & counts, size_t length) {
+            size_t total = 0;
+            std::vector<std::pair<size_t, size_t>> sorted;
+            for (size_t i = 0; i < counts.size(); ++i) {
+                total += counts[i];
+                if (counts[i] != 0)
+                    sorted.push_back(std::make_pair(counts[i], i));
+            }
+            std::sort(sorted.begin(), sorted.end(), std::greater<std::pair<size_t, size_t>>());
+            if (sorted.size() > top)
+                sorted.resize(top);
+            for (auto const & x : sorted) {
+                std::string name;
+                for (size_t i = 0, index = x.second; i < length; ++i, index /= Instruction::COUNT)
+                    name = std::string(mnemonic(index % Instruction::COUNT)) + (name.empty() ? "" : " ") + name;
+                s << std::setw(12) << x.first << std::setw(7) << std::fixed << std::setprecision(2) << 100.0 * x.first / total << " %  " << name << std::endl;
+            }
+        };
+        s << "Opcode pairs:" << std::endl;
+        printTop(pairs_, 2);
+        s << "Opcode triples:" << std::endl;
+        printTop(triples_, 3);
+    }
+
+} // namespace secd
@@ -1,292 +1,707 @@
-#pragma once
-
-#include "value.h"
-#include "runtime.h"
-#include "data_types.h"
-
-/** SECD Virtual Machine Compiler & Interpreter
-
- */
-namespace secd {
-
-    void printCode(Value const & code);
-
-    class Instruction {
-    public:
-        static int constexpr NIL = 0;
-        static int constexpr LDC = 1;
-        static int constexpr LD = 2;
-        static int constexpr SEL = 3;
-        static int constexpr JOIN = 4;
-        static int constexpr LDF = 5;
-        static int constexpr AP = 6;
-        static int constexpr RTN = 7;
-        static int constexpr DUM = 8;
-        static int constexpr RAP = 9;
-        static int constexpr DEFUN = 10;
-        static int constexpr POP = 11;
-
-        static int constexpr CONS = 90;
-        static int constexpr CAR = 91;
-        static int constexpr CDR = 92;
-        static int constexpr CONSP = 94;
-        
-        static int constexpr ADD = 100;
-        static int constexpr SUB = 101;
-        static int constexpr MUL = 102;
-        static int constexpr DIV = 103;
-        static int constexpr EQ = 104;
-        static int constexpr LT = 105;
-        static int constexpr GT = 106;
-
-        static int constexpr PRINT = 110;
-        static int constexpr READ = 111;
-        
-    };
-
-    /** Compiles the s-expressions into the SECD bytecode.
-     */
-    class Compiler {
-    public:
-        Compiler():
-            code_(nullptr),
-            envMap_(new EnvironmentMap(nullptr)) {
-        }
-
-        ~Compiler() {
-            delete envMap_;
-        }
-
-        Value compileSource(Value const & source);
-
-    private:
-
-        /** Models the environment during the compilation so that local variables can be found.
-
-            */
-        class EnvironmentMap {
-        public:
-
-            EnvironmentMap(EnvironmentMap * parent):
-                parent_(parent) {
-            }
-
-            ~EnvironmentMap() {
-                delete parent_;
-            }
-            
-            /** Adds new symbol to the environment map.
-             */
-            void addSymbol(Value const & name) {
-                envMap_.insert(std::make_pair(name.name(), envMap_.size()));
-            }
-
-            /** Returns the index of the given symbol in the current compilation environment hierarchy.
-             */
-            Value indexOf(Value const & symbol) {
-                assert(symbol.isSymbol() && "Expecting variable name");
-                std::string const & name = symbol.name();
-                EnvironmentMap * e = this;
-                int depth = 0;
-                while (e != nullptr) {
-                    auto i = e->envMap_.find(name);
-                    if (i != e->envMap_.end()) // found
-                        return Value::Cons(Value::Integer(depth), Value::Integer(i->second));
-                    ++depth;
-                    e = e->parent_;
-                }
-                throw std::runtime_error(STR("Unknown variable " << symbol));
-            }
-
-            EnvironmentMap * parent() const {
-                return parent_;
-            }
-
-            void detach() {
-                assert(parent_ != nullptr && "Global env should not be detached");
-                parent_ = nullptr;
-            }
-
-        private:
-            /** Parent environment map.
-             */
-            EnvironmentMap * parent_;
-
-            /** Current environment map, which goes from symbols to integers denoting their offset in the current environment.
-             */
-            std::unordered_map<std::string, int64_t> envMap_;
-        };
-
-        /** The code translated.
-         */
-        class Code {
-        public:
-            Code(Code * parent):
-                parent_(parent) {
-            }
-
-            ~Code() {
-                delete parent_;
-            }
-
-            Code * parent() const {
-                return parent_;
-            }
-
-            operator Value () {
-                return code_;
-            }
-
-            void detach() {
-                assert(parent_ != nullptr && "Cannot detach global code");
-                parent_ = nullptr;
-            }
-
-            void add(int opcode) {
-                code_.append(Value::Integer(opcode));
-            }
-
-            void add(Value const & value) {
-                code_.append(value);
-            }
-
-        private:
-            Code * parent_;
-            List code_;
-        }; // Compiler::Code
-
-        void enterNewEnv(Value names);
-        void unrollEnvironmentMap();
-
-        void enterNewCode();
-        void unrollAndAppendCode();
-
-        void compileInteger(Value const & code);
-        void compileNil();
-        void compileTrue();
-        void compileVariableRead(Value const & code);
-        void compileCall(Value const & code);
-        void compileUnaryOperator(int opcode, Value args);
-        void compileBinaryOperator(int opcode, Value args);
-        void compileRead(Value const & args);
-        void compileIf(Value args);
-        void compileLambda(Value args);
-        void compileLambda(Value argNames, Value body);
-        void compileQuote(Value args);
-        void compileApply(Value args);
-        void compileLet(Value args);
-        void compileLetrec(Value args);
-        void compileProgn(Value args);
-        void compileDefun(Value args);
-        void compileCallArguments(Value call);
-        //            void compileFunctionCall(Value const & func, Value const & args);
-        void compileFunctionArgs(Value const & args);
-        void compile(Value const & code);
-        
-        
-        Code * code_;
-        EnvironmentMap * envMap_;
-    };
-
-    /** Implements the environment and environment chain as required for the SECD machine implementation.
-
-        */
-    class Environment {
-    public:
-        /** Creates an empty environment.
-
-            An empty environment is environment whose parent is nil, and which itself is an empty list.
-        */
-        Environment():
-            v_(Value::Cons(Nil, Nil)) {
-        }
-
-        Environment(Value const & value):
-            v_(value) {
-            assert(v_.isCons() && "Environment must be at least an empty environment");
-        }
-
-        Value locate(Value const & index) {
-            int64_t depth = index.car().valueInt();
-            int64_t offset = index.cdr().valueInt();
-            Value x = v_;
-            while (depth-- > 0)
-                x = x.cdr();
-            x = x.car();
-            while (offset-- > 0)
-                x = x.cdr();
-            return x.car();
-        }
-
-        void append(Value const & value) {
-            Value e = v_.car();
-            if (e == Nil) {
-                v_.setCar(Value::Cons(value, Nil));
-            } else {
-                while (e.cdr() != Nil)
-                    e = e.cdr();
-                e.setCdr(Value::Cons(value, Nil));
-            }
-        }
-
-        void insertDummyEnvironment() {
-            v_ = Value::Cons(Nil, v_);
-        }
-
-        void popDummyEnvironment() {
-            assert(v_.car() == Nil && "Dummy environment expected");
-            v_ = v_.cdr();
-        }
-
-        operator Value & () {
-            return v_;
-        }
-
-
-    private:
-
-        Value v_;
-    }; // secd::Environment
-
-#ifdef HAHA    
-
-    class Runtime : public ::tlisp::Runtime {
-    public:
-        
-        Value compile(Value const & source) override {
-            return compiler_.compileSource(source);
-        }
-
-        Value run(Value const & source) override;
-
-        
-
-    private:
-        Compiler compiler_;
-
-        /** The stack register.
-
-            Holds the arguments to operations and function calls. Similar in function to the operand stack in stack-based ISAs.  
-            */
-        Stack s_;
-
-        /** The environment register.
-         */
-        Environment e_;
-
-        /** The control register.
-
-            Holds the program to be executed. car(c) is the next instruction to be executed. Functionally similar to the program counter. 
-            */
-        Stack c_;
-
-        /** The dump register.
-
-            Stores the backups of the other three registers for non-linear control flow operations. Functionally similar to call stack. 
-            */
-        Stack d_;
-    };
-
-#endif
-    
-} // namespace secd
+#pragma once
+
+#include "value.h"
+#include "runtime.h"
+#include "data_types.h"
+#include "bytecode.h"
+#include "optimizer.h"
+#include "jit.h"
+
+/** SECD Virtual Machine Compiler & Interpreter
+
+ */
+namespace secd {
+
+    void printCode(Value const & code);
+
+    /** Disassembles the whole bytecode, one instruction per line prefixed with its offset.
+     */
+    void printCode(Bytecode const & code);
+
+    /** The opcodes are numbered densely so that the interpreter can dispatch through a table indexed by them.
+     */
+    class Instruction {
+    public:
+        static int constexpr NIL = 0;
+        static int constexpr LDC = 1;
+        static int constexpr LD = 2;
+        static int constexpr SEL = 3;
+        static int constexpr JOIN = 4;
+        static int constexpr LDF = 5;
+        static int constexpr AP = 6;
+        static int constexpr RTN = 7;
+        static int constexpr DUM = 8;
+        static int constexpr RAPN = 9;
+        static int constexpr DEFUN = 10;
+        static int constexpr POP = 11;
+        /** Ends the program, only used by the flat bytecode.
+         */
+        static int constexpr STOP = 12;
+
+        static int constexpr CONS = 13;
+        static int constexpr CAR = 14;
+        static int constexpr CDR = 15;
+        static int constexpr CONSP = 16;
+        
+        static int constexpr ADD = 17;
+        static int constexpr SUB = 18;
+        static int constexpr MUL = 19;
+        static int constexpr DIV = 20;
+        static int constexpr EQ = 21;
+        static int constexpr LT = 22;
+        static int constexpr GT = 23;
+
+        static int constexpr PRINT = 24;
+        static int constexpr READ = 25;
+
+        /** Loads from the current and the parent environment frame, only used by the flat bytecode. The parent of the arguments frame of a function is the frame of its captured variables.
+         */
+        static int constexpr LD0 = 26;
+        static int constexpr LD1 = 27;
+
+        /** Calls in tail position, which do not push a new frame to the dump.
+         */
+        static int constexpr TAP = 28;
+        static int constexpr TRAPN = 29;
+
+        /** Calls with the given number of arguments on the stack, the top one being the first argument, so that no argument list is consed. AP and TAP take the argument list instead and are only used by apply.
+         */
+        static int constexpr APN = 30;
+        static int constexpr TAPN = 31;
+
+        /** Conditionals whose condition is a comparison, or a test for nil. They branch as SEL does on the result of the comparison of the values on the stack, without pushing it.
+         */
+        static int constexpr BLT = 32;
+        static int constexpr BGT = 33;
+        static int constexpr BEQ = 34;
+        static int constexpr BNIL = 35;
+
+        /** Superinstructions, only used by the flat bytecode.
+         */
+        static int constexpr LDC_LD0_ADD = 36;
+        static int constexpr LDC_LD0_SUB = 37;
+        static int constexpr LDC_LD0_LT = 38;
+        static int constexpr LDC_LD0_GT = 39;
+        static int constexpr LDC_LD0_EQ = 40;
+        static int constexpr LD0_LD0_ADD = 41;
+        static int constexpr LDG_APN = 42;
+        static int constexpr LDG_TAPN = 43;
+        static int constexpr LDC_LD0_BLT = 44;
+        static int constexpr LDC_LD0_BGT = 45;
+        static int constexpr LDC_LD0_BEQ = 46;
+
+        /** Quickened forms of the operators, only used by the flat bytecode. The interpreter rewrites the generic instruction to its quickened form when it sees operands of the expected kinds, i.e. immediate integers, symbols or cons cells. The quickened form only checks the tags of its operands and rewrites itself back when they do not match.
+         */
+        static int constexpr ADD_II = 47;
+        static int constexpr SUB_II = 48;
+        static int constexpr LT_II = 49;
+        static int constexpr GT_II = 50;
+        static int constexpr EQ_II = 51;
+        static int constexpr EQ_SYM = 52;
+        static int constexpr CAR_C = 53;
+        static int constexpr CDR_C = 54;
+
+        /** Loads a global variable, i.e. one defined by defun, from the global frame.
+         */
+        static int constexpr LDG = 55;
+
+        /** Loads the frame at the given depth of the environment, which is how a closure captures the variables of a letrec whose values are being evaluated.
+         */
+        static int constexpr LDE = 56;
+
+        /** Loads a slot of the frame captured by LDE, the operands being the address of the captured frame and the slot.
+         */
+        static int constexpr LDB = 57;
+
+        /** Number of opcodes.
+         */
+        static int constexpr COUNT = 58;
+
+        /** The address of a variable, i.e. the operand of LD, is its depth and offset packed in a single immediate integer.
+         */
+        static int64_t Address(int64_t depth, int64_t offset) {
+            assert(depth >= 0 && depth <= UINT32_MAX && offset >= 0 && offset <= UINT32_MAX && "Variable address out of range");
+            return (depth << 32) | offset;
+        }
+
+        static int64_t AddressDepth(int64_t address) {
+            return address >> 32;
+        }
+
+        static int64_t AddressOffset(int64_t address) {
+            return address & UINT32_MAX;
+        }
+        
+    };
+
+    /** Compiles the s-expressions into the SECD bytecode.
+     */
+    class Compiler {
+    public:
+        Compiler():
+            code_(nullptr),
+            envMap_(new EnvironmentMap(nullptr, EnvironmentMap::Kind::Global)) {
+        }
+
+        ~Compiler() {
+            delete envMap_;
+        }
+
+        Value compileSource(Value const & source);
+
+        /** The optimizer the source is passed through before it is compiled.
+         */
+        Optimizer & optimizer() {
+            return optimizer_;
+        }
+
+        /** Number of global variables the compiled code refers to, i.e. the size of the global frame it expects.
+         */
+        size_t globals() const {
+            return envMap_->global()->size();
+        }
+
+    private:
+
+        /** Location of a variable as seen from the code being compiled.
+         */
+        struct Variable {
+            enum class Kind {
+                /** Slot of the global frame.
+                 */
+                Global,
+                /** Slot of a frame at the given depth of the environment, which includes the captured variables of the function.
+                 */
+                Local,
+                /** Slot of the frame of a letrec whose values are being evaluated. It is read as a local variable, but closures capture the whole frame as the slot is filled in only later by RAPN.
+                 */
+                Letrec,
+                /** Slot of a letrec frame, which is itself a captured variable at the given depth and offset.
+                 */
+                Boxed,
+            };
+
+            Kind kind;
+            int64_t depth;
+            int64_t offset;
+            int64_t slot;
+        };
+
+        /** Models the environment during the compilation so that local variables can be found.
+
+            Each function has its own frame for the arguments, whose parent is the frame of the variables the function captures. Global variables are not captured, they are read from the global frame directly. When a function uses a variable of an enclosing function, the variable is added to the captured variables of each function in between, so that the closure only keeps the values it needs alive and any variable is at most one frame away from the function's own frame. Only letrec adds frames to the environment within a function.
+            */
+        class EnvironmentMap {
+        public:
+
+            enum class Kind {
+                Global,
+                Function,
+                Letrec,
+            };
+
+            EnvironmentMap(EnvironmentMap * parent, Kind kind):
+                parent_(parent),
+                kind_(kind) {
+            }
+
+            ~EnvironmentMap() {
+                delete parent_;
+            }
+            
+            /** Adds new symbol to the environment map and returns its slot.
+
+                Every symbol gets a new slot, as the frame does at runtime. A symbol added again, such as a redefined global function, refers to the new slot from then on, while the code compiled before keeps using the old one. Global functions are thus bound early, a redefinition is only seen by the code compiled after it.
+             */
+            int64_t addSymbol(Value const & name) {
+                if (kind_ == Kind::Global) {
+                    auto i = envMap_.find(name.name());
+                    changes_.push_back(std::make_pair(name.name(), i == envMap_.end() ? NoSlot : i->second));
+                }
+                envMap_[name.name()] = size_;
+                return size_++;
+            }
+
+            /** Number of slots of the environment.
+             */
+            size_t size() const {
+                return static_cast<size_t>(size_);
+            }
+
+            /** Remembers the symbols added so far, to be called once the global expression has been compiled.
+             */
+            void commit() {
+                changes_.clear();
+                committedSize_ = size_;
+            }
+
+            /** Forgets the symbols added since the last commit, to be called if the global expression failed to compile, so that its functions are not visible to the following expressions and their slots are reused.
+             */
+            void rollback() {
+                for (auto i = changes_.rbegin(); i != changes_.rend(); ++i) {
+                    if (i->second == NoSlot)
+                        envMap_.erase(i->first);
+                    else
+                        envMap_[i->first] = i->second;
+                }
+                changes_.clear();
+                size_ = committedSize_;
+            }
+
+            /** Returns the location of the given symbol in the current compilation environment hierarchy, capturing it by the enclosing functions if necessary.
+             */
+            Variable lookup(Value const & symbol) {
+                assert(symbol.isSymbol() && "Expecting variable name");
+                std::string const & name = symbol.name();
+                int64_t depth = 0;
+                for (EnvironmentMap * e = this; ; e = e->parent_, ++depth) {
+                    auto i = e->envMap_.find(name);
+                    if (i != e->envMap_.end()) { // found
+                        if (e->kind_ == Kind::Global)
+                            return Variable{Variable::Kind::Global, 0, i->second, 0};
+                        return Variable{e->kind_ == Kind::Letrec ? Variable::Kind::Letrec : Variable::Kind::Local, depth, i->second, 0};
+                    }
+                    if (e->kind_ == Kind::Global)
+                        throw std::runtime_error(STR("Unknown variable " << symbol));
+                    if (e->kind_ == Kind::Function)
+                        return e->capture(symbol, depth + 1);
+                }
+            }
+
+            /** Variables captured by the function, in the order of the slots of its captured frame. Their locations are relative to the environment in which the closure is created.
+             */
+            std::vector<Variable> const & captures() const {
+                return captures_;
+            }
+
+            /** Returns the map of the global environment.
+             */
+            EnvironmentMap * global() {
+                EnvironmentMap * e = this;
+                while (e->parent_ != nullptr)
+                    e = e->parent_;
+                return e;
+            }
+
+            EnvironmentMap * parent() const {
+                return parent_;
+            }
+
+            void detach() {
+                assert(parent_ != nullptr && "Global env should not be detached");
+                parent_ = nullptr;
+            }
+
+        private:
+
+            /** Returns the location of the variable captured by the function, given the depth of its captured frame.
+             */
+            Variable capture(Value const & symbol, int64_t depth) {
+                auto i = captured_.find(symbol.name());
+                size_t index;
+                if (i == captured_.end()) {
+                    Variable source = parent_->lookup(symbol);
+                    if (source.kind == Variable::Kind::Global)
+                        return source;
+                    index = captures_.size();
+                    captures_.push_back(source);
+                    captured_[symbol.name()] = index;
+                } else {
+                    index = i->second;
+                }
+                Variable const & source = captures_[index];
+                switch (source.kind) {
+                case Variable::Kind::Local:
+                    return Variable{Variable::Kind::Local, depth, static_cast<int64_t>(index), 0};
+                case Variable::Kind::Letrec:
+                    return Variable{Variable::Kind::Boxed, depth, static_cast<int64_t>(index), source.offset};
+                default:
+                    return Variable{Variable::Kind::Boxed, depth, static_cast<int64_t>(index), source.slot};
+                }
+            }
+
+            /** Parent environment map.
+             */
+            EnvironmentMap * parent_;
+
+            Kind kind_;
+
+            /** Current environment map, which goes from symbols to integers denoting their offset in the current environment.
+             */
+            std::unordered_map<std::string, int64_t> envMap_;
+
+            /** Number of slots of the environment.
+             */
+            int64_t size_ = 0;
+
+            static int64_t constexpr NoSlot = -1;
+
+            /** Symbols of the global environment added since the last commit with their previous slots, or NoSlot if they were not defined, so that a failed expression can be undone without copying the whole map for every expression.
+             */
+            std::vector<std::pair<std::string, int64_t>> changes_;
+
+            /** Number of slots as of the last commit.
+             */
+            int64_t committedSize_ = 0;
+
+            std::vector<Variable> captures_;
+
+            /** Indices of the captured variables.
+             */
+            std::unordered_map<std::string, size_t> captured_;
+        };
+
+        /** The code translated.
+         */
+        class Code {
+        public:
+            Code(Code * parent):
+                parent_(parent) {
+            }
+
+            ~Code() {
+                delete parent_;
+            }
+
+            Code * parent() const {
+                return parent_;
+            }
+
+            operator Value () {
+                return code_;
+            }
+
+            void detach() {
+                assert(parent_ != nullptr && "Cannot detach global code");
+                parent_ = nullptr;
+            }
+
+            void add(int opcode) {
+                code_.append(Value::Integer(opcode));
+            }
+
+            void add(Value const & value) {
+                code_.append(value);
+            }
+
+        private:
+            Code * parent_;
+            List code_;
+        }; // Compiler::Code
+
+        void enterNewEnv(Value names, EnvironmentMap::Kind kind);
+        void unrollEnvironmentMap();
+
+        void enterNewCode();
+        /** Restores the parent code and returns the code compiled since enterNewCode.
+         */
+        Value unrollCode();
+        void unrollAndAppendCode();
+
+        void compileInteger(Value const & code);
+        void compileNil();
+        void compileTrue();
+        void compileVariableRead(Value const & code);
+        /** Loads the value of a variable captured by a closure being created, i.e. the frame itself if the variable is a letrec variable which may not be defined yet.
+         */
+        void compileCapture(Variable const & variable);
+        void compileCall(Value const & code, bool tail);
+        void compileUnaryOperator(int opcode, Value args);
+        void compileBinaryOperator(int opcode, Value args);
+        void compileRead(Value const & args);
+        void compileIf(Value args, bool tail);
+        int compileCondition(Value const & condition);
+        void compileLambda(Value args);
+        void compileLambda(Value argNames, Value body);
+        void compileQuote(Value args);
+        void compileApply(Value args, bool tail);
+        void compileLet(Value args, bool tail);
+        void compileLetrec(Value args, bool tail);
+        void compileProgn(Value args, bool tail);
+        void compileDefun(Value args);
+        //            void compileFunctionCall(Value const & func, Value const & args);
+        size_t compileFunctionArgs(Value const & args);
+        /** Compiles the expression, emitting tail calls if it is in tail position, i.e. its value is returned by the enclosing function.
+         */
+        void compile(Value const & code, bool tail = false);
+        
+        
+        Code * code_;
+        EnvironmentMap * envMap_;
+        Optimizer optimizer_;
+    };
+
+    /** Implements the environment and environment chain as required for the SECD machine implementation.
+
+        Each environment is a frame holding the values of its variables in contiguous slots and a pointer to the parent frame, so that a variable is located by following depth parents and indexing the slots. The parent of the arguments frame of a function is the flat frame of the variables its closure captured, whose parent is nil. The global variables are kept in a separate frame, which is also the environment of the top level code.
+        */
+    class Environment {
+    public:
+        /** Creates an empty environment.
+
+            An empty environment is a frame with no slots whose parent is nil.
+        */
+        Environment():
+            v_(Value::Frame(0, Nil)),
+            globals_(v_) {
+        }
+
+        /** Makes the given frame the current environment, the global frame is kept.
+         */
+        Environment & operator = (Value const & value) {
+            assert(value.isFrame() && "Environment must be at least an empty environment");
+            v_ = value;
+            return *this;
+        }
+
+        ValueRef locate(int64_t address) const {
+            return locate(Instruction::AddressDepth(address), Instruction::AddressOffset(address));
+        }
+
+        ValueRef locate(int64_t depth, int64_t offset) const {
+            ValueRef x = v_;
+            while (depth-- > 0)
+                x = x.parent();
+            return x.slot(offset);
+        }
+
+        ValueRef local(int64_t offset) const {
+            return v_.ref().slot(offset);
+        }
+
+        ValueRef parent(int64_t offset) const {
+            return v_.ref().parent().slot(offset);
+        }
+
+        ValueRef global(int64_t offset) const {
+            return globals_.ref().slot(offset);
+        }
+
+        /** Returns the frame at the given depth.
+         */
+        ValueRef frame(int64_t depth) const {
+            ValueRef x = v_;
+            while (depth-- > 0)
+                x = x.parent();
+            return x;
+        }
+
+        /** Makes the global frame at least the given number of slots large.
+
+            The compiler assigns the slots of the global variables, the frame is grown before the code using them runs, so that the slots stay in sync even if the code defining a variable fails before it gets to it.
+         */
+        void reserveGlobals(size_t size) {
+            if (globals_.frameSize() < size)
+                globals_.resizeFrame(size);
+        }
+
+        /** Sets the value of the global variable in the given slot.
+         */
+        void define(int64_t slot, Value const & value) {
+            assert(static_cast<size_t>(slot) < globals_.frameSize() && "Global slot not reserved");
+            globals_.setSlot(slot, value);
+        }
+
+        /** Inserts a frame with no slots, which is filled in later by RAPN.
+         */
+        void insertDummyEnvironment() {
+            v_ = Value::Frame(0, v_);
+        }
+
+        /** Removes the dummy frame from the environment and returns it.
+         */
+        Value popDummyEnvironment() {
+            assert(v_.frameSize() == 0 && "Dummy environment expected");
+            Value result = v_;
+            v_ = v_.parent();
+            return result;
+        }
+
+        /** Pops the current frame from the frame region if it is the topmost frame there, used when the frame dies by a tail call.
+         */
+        void release() {
+            v_.ref().popRegionFrame();
+        }
+
+        /** Returns to the global environment.
+         */
+        void unwind() {
+            v_ = globals_;
+        }
+
+        operator Value & () {
+            return v_;
+        }
+
+        operator ValueRef () const {
+            return v_;
+        }
+
+
+    private:
+        friend class Jit;
+
+        Value v_;
+
+        Value globals_;
+    }; // secd::Environment
+
+    /** Numbers of pairs and triples of opcodes executed in a row.
+
+        Collected by the interpreter only when compiled with SECD_PROFILE_OPCODES so that the dispatch is not slowed down otherwise. Used to find the sequences worth fusing into superinstructions.
+     */
+    class OpcodeProfile {
+    public:
+
+        void record(uint32_t opcode) {
+            if (pairs_.empty()) {
+                pairs_.resize(Instruction::COUNT * Instruction::COUNT);
+                triples_.resize(Instruction::COUNT * Instruction::COUNT * Instruction::COUNT);
+            }
+            if (last_ != None) {
+                ++pairs_[last_ * Instruction::COUNT + opcode];
+                if (secondLast_ != None)
+                    ++triples_[(secondLast_ * Instruction::COUNT + last_) * Instruction::COUNT + opcode];
+            }
+            secondLast_ = last_;
+            last_ = opcode;
+        }
+
+        /** Breaks the sequence, so that the next recorded opcode does not form a pair with the previous one.
+         */
+        void interrupt() {
+            secondLast_ = last_ = None;
+        }
+
+        void clear() {
+            pairs_.clear();
+            triples_.clear();
+            interrupt();
+        }
+
+        /** Prints the given number of the most frequent pairs and triples.
+         */
+        void print(std::ostream & s, size_t top = 20) const;
+
+    private:
+
+        static uint32_t constexpr None = UINT32_MAX;
+
+        std::vector<size_t> pairs_;
+        std::vector<size_t> triples_;
+        uint32_t last_ = None;
+        uint32_t secondLast_ = None;
+    }; // secd::OpcodeProfile
+
+    /** The SECD machine interpreter.
+
+        Compiled code is lowered to the flat bytecode before it runs. All code is appended to a single bytecode stream so that closures can refer to their bodies by the entry offset, which is stored in the closure as an immediate integer.
+
+        Instructions are dispatched through a table of handlers indexed by the opcode. With GCC and clang each handler jumps to the next one directly using computed goto, elsewhere, or if SECD_SWITCH_DISPATCH is defined, a switch in a loop is used. If SECD_PROFILE_OPCODES is defined, the executed opcode sequences are counted in the profile.
+
+        Functions invoked often enough are compiled to native code by the Jit, which shares the registers of the interpreter.
+     */
+    class Interpreter : public Runtime {
+    public:
+        
+        Value compile(Value const & source) override {
+            return compiler_.compileSource(source);
+        }
+
+        /** Lowers the compiled code to the bytecode and runs it, returning the value it leaves on the stack.
+         */
+        Value run(Value const & code) override;
+
+        Bytecode const & bytecode() const {
+            return bytecode_;
+        }
+
+        /** Number of instructions executed so far.
+         */
+        size_t instructions() const {
+            return instructions_;
+        }
+
+        OpcodeProfile & profile() {
+            return profile_;
+        }
+
+        Compiler & compiler() {
+            return compiler_;
+        }
+
+        Jit & jit() {
+            return jit_;
+        }
+
+    private:
+        friend class Jit;
+
+        Value execute(size_t pc);
+
+        /** Enters the closure with the given number of arguments from the top of the stack and returns its entry. The return address and the rest of the caller's state are pushed to the dump, unless the return address is 0 for a tail call.
+         */
+        size_t call(Value const & closure, size_t args, size_t returnAddress, char const * instruction);
+
+        /** Enters the closure with the argument list from the top of the stack, as call does.
+         */
+        size_t apply(Value const & closure, size_t returnAddress, char const * instruction);
+
+        /** Enters the body of a letrec with the given number of values from the top of the stack, as call does. The values are stored to the dummy frame created by DUM, which becomes the arguments frame of the body.
+         */
+        size_t callRecursive(Value const & closure, size_t args, size_t returnAddress, char const * instruction);
+
+        /** Makes the frame the current environment and returns the entry of the closure. Unless the return address is 0, the caller's state is pushed to the dump with the given top of the frame region, to which RTN pops the region.
+         */
+        size_t enter(Value const & closure, Value const & frame, size_t returnAddress, size_t region);
+
+        /** Returns from the current function with the value on the top of the stack, restoring the caller's state from the dump, and returns the return address.
+         */
+        size_t leave();
+
+        /** Runtime calls of the native code, see Jit.
+
+            Each executes its instruction with the given operands as the handler of the instruction does and returns the native code to continue with, which is the exit to the interpreter if the code to continue with has not been compiled, or if an error has been thrown. The runtime calls that continue with the next instruction return false on error instead.
+         */
+        static void * NativeCall(Interpreter & self, size_t args, size_t returnAddress);
+        static void * NativeCallGlobal(Interpreter & self, size_t offset, size_t args, size_t returnAddress);
+        static void * NativeApply(Interpreter & self, size_t returnAddress);
+        static void * NativeCallRecursive(Interpreter & self, size_t args, size_t returnAddress);
+        static void * NativeReturn(Interpreter & self);
+        static bool NativeClosure(Interpreter & self, size_t captures, size_t entry);
+        static bool NativeCons(Interpreter & self);
+        static bool NativeDummy(Interpreter & self);
+        /** Makes sure the given number of values can be pushed on the stack without growing it, as the native code does not check.
+         */
+        static bool NativeReserve(Interpreter & self, size_t values);
+
+        Compiler compiler_;
+
+        Bytecode bytecode_;
+
+        /** The stack register.
+
+            Holds the arguments to operations and function calls. Similar in function to the operand stack in stack-based ISAs. The stack of the called function starts above the caller's one, whose height is saved in the dump.
+            */
+        ValueStack s_;
+
+        /** The environment register.
+         */
+        Environment e_;
+
+        /** The dump register.
+
+            Stores the backups of the stack, environment and the program counter for function calls. Functionally similar to call stack. The control register is the program counter, which is local to the interpreter loop.
+
+            Each frame consists of four slots: the top of the frame region before the call, the height of the caller's stack, the caller's environment and the return address, the numbers stored as immediate integers so that the GC can scan the dump as is.
+            */
+        ValueStack d_;
+
+        size_t instructions_ = 0;
+
+        OpcodeProfile profile_;
+
+        Jit jit_{*this};
+    }; // secd::Interpreter
+    
+} // namespace secd
@@ -40,6 +40,8 @@ namespace secd {
         if (i == symbols_.end()) {
             std::string * str = new std::string(name);
             i = symbols_.insert(std::make_pair(str, new GC::Cell(str))).first;
+            // symbols are interned for the whole program run so the table entry itself is a root
+            GC::AddRoot(i->second);
         }
         return i->second;
     }
@@ -47,7 +49,7 @@ namespace secd {
     Value const Nil = Symbol::ForName("nil");
     Value const T = Value::Integer(1);
 
-    std::ostream & operator << (std::ostream & s, Value const & value) {
+    std::ostream & operator << (std::ostream & s, ValueRef value) {
         switch (value.kind()) {
         case GC::CellKind::Integer:
             s << value.valueInt();
@@ -57,7 +59,7 @@ namespace secd {
             break;
         case GC::CellKind::Cons: {
                 s << "(";
-                Value c(value);
+                ValueRef c(value);
                 s << c.car();
                 while (c.cdr().isCons()) {
                     s << " ";
@@ -75,6 +77,9 @@ namespace secd {
                 s << "Dunno yet how to print closures properly";
                 break;
             }
+        case GC::CellKind::Frame:
+            s << "#<frame of " << value.frameSize() << ">";
+            break;
         }
         return s;
     }
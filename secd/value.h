@@ -8,9 +8,132 @@
 
 namespace secd {
 
+    class Value;
+
+    /** Borrowed reference to a tinyLISP object.
+
+        Unlike Value, the reference does not register itself as a GC root and is therefore free to create and copy. It is only valid for as long as the object is reachable from a rooted Value and must not be held across allocations. Intended for internal hot paths such as list traversals and comparisons.
+     */
+    class ValueRef {
+    public:
+
+        ValueRef(Value const & value);
+
+        /** Returns the kind of the value, i.e. the kind of its underlying cell.
+         */
+        GC::CellKind kind() const {
+            if (GC::IsImmediate(data_))
+                return GC::CellKind::Integer;
+            return data_->kind;
+        }
+
+        bool isInteger() const {
+            return kind() == GC::CellKind::Integer;
+        }
+
+        bool isSymbol() const {
+            return kind() == GC::CellKind::Symbol;
+        }
+
+        bool isCons() const {
+            return kind() == GC::CellKind::Cons;
+        }
+
+        bool isClosure() const {
+            return kind() == GC::CellKind::Closure;
+        }
+
+        bool isFrame() const {
+            return kind() == GC::CellKind::Frame;
+        }
+
+        /** Returns true if the value is an integer stored directly in the reference.
+         */
+        bool isImmediate() const {
+            return GC::IsImmediate(data_);
+        }
+
+        /** Returns a reference to an immediate integer, which is valid regardless of any allocations.
+         */
+        static ValueRef Immediate(int64_t value) {
+            return ValueRef(GC::MakeImmediate(value));
+        }
+
+        int64_t valueInt() const {
+            assert(isInteger() && "Accessing numeric value of non-integer cell");
+            if (GC::IsImmediate(data_))
+                return GC::ImmediateValue(data_);
+            return data_->valueInt;
+        }
+
+        std::string const & name() const {
+            assert(isSymbol() && "Accessing name of non-symbol cell");
+            return * data_->name;
+        }
+
+        ValueRef car() const {
+            assert(isCons() && "Accessing car of non-cons cell");
+            return ValueRef(data_->car);
+        }
+
+        ValueRef cdr() const {
+            assert(isCons() && "Accessing cdr of non-cons cell");
+            return ValueRef(data_->cdr);
+        }
+
+        ValueRef body() const {
+            assert(isClosure() && "Accessing body of non-closure cell");
+            return ValueRef(data_->body);
+        }
+
+        ValueRef environment() const {
+            assert(isClosure() && "Accessing environment of non-closure cell");
+            return ValueRef(data_->environment);
+        }
+
+        ValueRef parent() const {
+            assert(isFrame() && "Accessing parent of non-frame cell");
+            return ValueRef(data_->parent);
+        }
+
+        size_t frameSize() const {
+            return data_->frameSize();
+        }
+
+        ValueRef slot(size_t index) const {
+            assert(index < frameSize() && "Frame slot out of bounds");
+            return ValueRef(data_->slots[index]);
+        }
+
+        /** Pops the frame from the frame region of the GC if it is the topmost frame there, see GC::PopRegionFrame.
+         */
+        void popRegionFrame() const {
+            assert(isFrame() && "Popping non-frame cell");
+            GC::PopRegionFrame(data_);
+        }
+
+        bool operator == (ValueRef other) const {
+            return data_ == other.data_;
+        }
+
+        bool operator != (ValueRef other) const {
+            return data_ != other.data_;
+        }
+
+    private:
+        friend class Value;
+        friend class ValueStack;
+
+        explicit ValueRef(GC::Cell * data):
+            data_(data) {
+        }
+
+        GC::Cell * data_;
+    }; // secd::ValueRef
+
     /** Representation of a tinyLISP object.
 
-        The value acts both as a smart pointer that registers itself automatically as a GC root when used and as a checked accessor to the contents of the underlying GC Cell. 
+        The value acts both as a smart pointer that registers itself automatically as a GC root when used and as a checked accessor to the contents of the underlying GC Cell. Roots are kept on the GC's shadow stack so that the common case of values created and destroyed in LIFO order is a push and a pop. Moving a value hands its root slot over instead of registering a new one, the moved-from value is left unrooted until assigned to again. A moved-from value must not be copied, moved or assigned from.
      */
     class Value {
     public:
@@ -23,10 +146,36 @@ namespace secd {
          */
         Value(Value const & from):
             data_(from.data_) {
+            assert(data_ != nullptr && "Copying moved-from value");
+            GC::AddRoot(data_);
+        }
+
+        /** Move constructor takes over the root slot of the moved-from value.
+
+            It does not throw, so that containers of values move them when they grow instead of copying them.
+         */
+        Value(Value && from) noexcept:
+            data_(from.data_) {
+            assert(data_ != nullptr && "Moving moved-from value");
+            GC::MoveRoot(from.data_, data_);
+            from.data_ = nullptr;
+        }
+
+        /** Roots a borrowed reference.
+         */
+        Value(ValueRef from):
+            data_(from.data_) {
+            assert(data_ != nullptr && "Rooting reference to moved-from value");
             GC::AddRoot(data_);
         }
 
+        /** Creates an integer value.
+
+            Integers that fit in 63 bits are stored as tagged immediates and do not allocate, only larger values are boxed in an Integer cell.
+         */
         static Value Integer(int64_t value) {
+            if (GC::FitsImmediate(value))
+                return Value(GC::MakeImmediate(value));
             return Value(new GC::Cell(GC::CellKind::Integer, value));
         }
 
@@ -38,100 +187,166 @@ namespace secd {
             return Value(new GC::Cell(GC::CellKind::Closure, body.data_, environment.data_));
         }
 
+        /** Creates an environment frame with the given number of slots, all set to Nil.
+         */
+        static Value Frame(size_t size, Value const & parent);
+
+        /** Creates an environment frame in the frame region of the GC, see GC::NewRegionFrame.
+         */
+        static Value RegionFrame(size_t size, Value const & parent);
+
         /** Value destructor removes the value from the list of GC roots.
          */
         ~Value() {
-            GC::RemoveRoot(data_);    
+            if (data_ != nullptr)
+                GC::RemoveRoot(data_);
+        }
+
+        /** Assignment only changes the cell the already rooted value points to, unless the value has been moved from.
+         */
+        Value & operator = (Value const & other) {
+            return *this = ValueRef(other);
+        }
+
+        Value & operator = (ValueRef other) {
+            assert(other.data_ != nullptr && "Assigning moved-from value");
+            if (data_ == nullptr)
+                GC::AddRoot(data_);
+            data_ = other.data_;
+            return *this;
+        }
+
+        Value & operator = (Value && other) noexcept {
+            assert(other.data_ != nullptr && "Assigning moved-from value");
+            if (data_ == nullptr && this != & other) {
+                GC::MoveRoot(other.data_, data_);
+                data_ = other.data_;
+                other.data_ = nullptr;
+                return *this;
+            }
+            data_ = other.data_;
+            return *this;
+        }
+
+        /** Returns a borrowed reference to the value.
+         */
+        ValueRef ref() const {
+            return ValueRef(data_);
         }
 
         /** Returns the kind of the value, i.e. the kind of its underlying cell.
          */
         GC::CellKind kind() const {
-            return data_->kind;
+            return ref().kind();
         }
 
         bool isInteger() const {
-            return kind() == GC::CellKind::Integer;
+            return ref().isInteger();
         }
         
         bool isSymbol() const {
-            return kind() == GC::CellKind::Symbol;
+            return ref().isSymbol();
         }
         
         bool isCons() const {
-            return kind() == GC::CellKind::Cons;
+            return ref().isCons();
         }
         
         bool isClosure() const {
-            return kind() == GC::CellKind::Closure;
+            return ref().isClosure();
         }
 
-        int64_t valueInt() const {
-            assert(isInteger() && "Accessing numeric value of non-integer cell");
-            return data_->valueInt;
+        bool isFrame() const {
+            return ref().isFrame();
         }
 
-        void setValueInt(int value) {
-            data_->kind = GC::CellKind::Integer;
-            data_->valueInt = value;
+        int64_t valueInt() const {
+            return ref().valueInt();
         }
 
         std::string const & name() const {
-            assert(isSymbol() && "Accessing name of non-symbol cell");
-            return * data_->name;
+            return ref().name();
         }
 
         Value car() const {
-            assert(isCons() && "Accessing car of non-cons cell");
-            return data_->car;
+            return ref().car();
         }
 
         Value cdr() const {
-            assert(isCons() && "Accessing cdr of non-cons cell");
-            return data_->cdr;
+            return ref().cdr();
         }
 
-        void setCar(Value const & value) {
+        void setCar(ValueRef value) {
             assert(isCons() && "Accessing car of non-cons cell");
+            GC::WriteBarrier(data_, value.data_);
             data_->car = value.data_;
         }
         
-        void setCdr(Value const & value) {
+        void setCdr(ValueRef value) {
             assert(isCons() && "Accessing cdr of non-cons cell");
+            GC::WriteBarrier(data_, value.data_);
             data_->cdr = value.data_;
         }
 
         Value body() const {
-            assert(isClosure() && "Accessing body of non-closure cell");
-            return data_->body;
+            return ref().body();
         }
         
         Value environment() const {
-            assert(isClosure() && "Accessing environment of non-closure cell");
-            return data_->environment;
+            return ref().environment();
         }
 
-        void setBody(Value const & value) {
+        void setBody(ValueRef value) {
             assert(isClosure() && "Accessing body of non-closure cell");
+            GC::WriteBarrier(data_, value.data_);
             data_->body = value.data_;
         }
         
-        void setEnvironment(Value const & value) {
+        void setEnvironment(ValueRef value) {
             assert(isClosure() && "Accessing environment of non-closure cell");
+            GC::WriteBarrier(data_, value.data_);
             data_->environment = value.data_;
         }
+
+        Value parent() const {
+            return ref().parent();
+        }
+
+        void setParent(ValueRef value) {
+            assert(isFrame() && "Accessing parent of non-frame cell");
+            GC::WriteBarrier(data_, value.data_);
+            data_->parent = value.data_;
+        }
+
+        size_t frameSize() const {
+            return ref().frameSize();
+        }
+
+        Value slot(size_t index) const {
+            return ref().slot(index);
+        }
+
+        void setSlot(size_t index, ValueRef value) {
+            assert(index < frameSize() && "Frame slot out of bounds");
+            GC::WriteBarrier(data_, value.data_);
+            data_->slots[index] = value.data_;
+        }
+
+        /** Changes the number of slots of the frame, new slots are set to Nil.
+         */
+        void resizeFrame(size_t size);
         
         /** Compares two Values.
 
-            Values are equal iff they point to the same cell.
+            Values are equal iff they point to the same cell. Immediate integers are equal iff their values are equal.
         */
-        bool operator == (Value other) const {
+        bool operator == (ValueRef other) const {
             return data_ == other.data_;
         }
 
         /** Inequality of Values.
          */
-        bool operator != (Value other) const {
+        bool operator != (ValueRef other) const {
             return data_ != other.data_;
         }
 
@@ -140,6 +355,9 @@ namespace secd {
     protected:
 
         friend class Symbol;
+        friend class ValueRef;
+        friend class ValueStack;
+        friend class Jit;
 
         Value(GC::Cell * data):
             data_(data) {
@@ -150,6 +368,12 @@ namespace secd {
         GC::Cell * data_;
     }; // tlisp::Value
 
+    static_assert(std::is_nothrow_move_constructible<Value>::value, "Values must be moved, not copied, when containers grow");
+
+    inline ValueRef::ValueRef(Value const & value):
+        data_(value.data_) {
+    }
+
     class Symbol {
     public:
         static Value const Empty;
@@ -214,9 +438,32 @@ namespace secd {
         GC::AddRoot(data_);
     }
 
+    inline Value Value::Frame(size_t size, Value const & parent) {
+        Value result(GC::NewFrame(parent.data_, size));
+        // the frame is either in the nursery, or the nursery is disabled, so no write barrier is needed
+        for (size_t i = 0; i < size; ++i)
+            result.data_->slots[i] = Nil.data_;
+        return result;
+    }
+
+    inline Value Value::RegionFrame(size_t size, Value const & parent) {
+        Value result(GC::NewRegionFrame(parent.data_, size));
+        // the frame is in the region, in the nursery or the nursery is disabled, so no write barrier is needed
+        for (size_t i = 0; i < size; ++i)
+            result.data_->slots[i] = Nil.data_;
+        return result;
+    }
+
+    inline void Value::resizeFrame(size_t size) {
+        size_t old = frameSize();
+        GC::ResizeFrame(data_, size);
+        for (size_t i = old; i < size; ++i)
+            setSlot(i, Nil);
+    }
+
     /** Prints the given value to the specified stream.
      */
-    std::ostream & operator << (std::ostream & s, Value const & v);
+    std::ostream & operator << (std::ostream & s, ValueRef v);
     
     
 } // namespace secd
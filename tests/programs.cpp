@@ -0,0 +1,96 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "reader.h"
+
+using namespace secd;
+
+/** Runs a test program and compares its output with the expected one.
+
+    Each top level s-expression of the program is compiled and run in turn and its result printed on a line of its own, errors are printed as "ERROR: " followed by the message, so that the output also covers the recovery of the interpreter from errors. Anything printed by the program itself is interleaved. If no expected output is given, the output is written to the standard output instead, which is how the expected outputs are created.
+
+    Usage: secd-programs [--no-inline] [--no-optimizer] program [expected]
+
+    The JIT threshold and the GC are configured by the SECD_JIT_THRESHOLD and SECD_GC_* environment variables.
+ */
+int main(int argc, char * argv[]) {
+    bool inlining = true;
+    bool optimizer = true;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; ++arg) {
+        if (strcmp(argv[arg], "--no-inline") == 0) {
+            inlining = false;
+        } else if (strcmp(argv[arg], "--no-optimizer") == 0) {
+            optimizer = false;
+        } else {
+            std::cerr << "Unknown option " << argv[arg] << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - arg < 1 || argc - arg > 2) {
+        std::cerr << "Usage: " << argv[0] << " [--no-inline] [--no-optimizer] program [expected]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::ifstream program(argv[arg]);
+    if (! program.good()) {
+        std::cerr << "Unable to open " << argv[arg] << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::stringstream source;
+    source << program.rdbuf();
+
+    std::stringstream output;
+    std::streambuf * console = std::cout.rdbuf(output.rdbuf());
+    {
+        Interpreter interpreter;
+        if (! inlining)
+            interpreter.compiler().optimizer().setInlineThreshold(0);
+        interpreter.compiler().optimizer().setEnabled(optimizer);
+        Reader reader(source.str());
+        while (! reader.eof()) {
+            Value x = reader.read();
+            try {
+                Value code = interpreter.compile(x);
+                std::cout << interpreter.run(code) << std::endl;
+            } catch (std::exception const & e) {
+                std::cout << "ERROR: " << e.what() << std::endl;
+            } catch (char const * e) {
+                std::cout << "ERROR: " << e << std::endl;
+            }
+        }
+    }
+    std::cout.rdbuf(console);
+
+    if (argc - arg == 1) {
+        std::cout << output.str();
+        return EXIT_SUCCESS;
+    }
+    std::ifstream expectedFile(argv[arg + 1]);
+    if (! expectedFile.good()) {
+        std::cerr << "Unable to open " << argv[arg + 1] << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string actual;
+    std::string expected;
+    size_t line = 1;
+    while (true) {
+        bool more = static_cast<bool>(std::getline(output, actual));
+        bool moreExpected = static_cast<bool>(std::getline(expectedFile, expected));
+        if (! more && ! moreExpected)
+            break;
+        if (! more)
+            actual = "<end of output>";
+        if (! moreExpected)
+            expected = "<end of output>";
+        if (actual != expected) {
+            std::cerr << argv[arg] << ", output line " << line << std::endl;
+            std::cerr << "    expected: " << expected << std::endl;
+            std::cerr << "    actual:   " << actual << std::endl;
+            return EXIT_FAILURE;
+        }
+        ++line;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+
+#include "secd/secd.h"
+
+namespace secd {
+
+    /** Reads the s-expressions of a program from its source text.
+
+        Integers, symbols, lists, dotted pairs and the quote character are supported, comments start with a semicolon and extend to the end of the line. Used by the program tests and the benchmarks, which do not depend on the parser of the rest of the project.
+     */
+    class Reader {
+    public:
+        explicit Reader(std::string source):
+            source_(std::move(source)),
+            pos_(0) {
+        }
+
+        /** Returns true if there are no more s-expressions to read.
+         */
+        bool eof() {
+            skipWhitespace();
+            return pos_ == source_.size();
+        }
+
+        Value read() {
+            skipWhitespace();
+            if (pos_ == source_.size())
+                throw std::runtime_error("Unexpected end of input");
+            char c = source_[pos_];
+            if (c == '(') {
+                ++pos_;
+                return readList();
+            }
+            if (c == ')')
+                throw std::runtime_error(STR("Unexpected ) at offset " << pos_));
+            if (c == '\'') {
+                ++pos_;
+                Value quoted = read();
+                return List{Symbol::Quote, quoted};
+            }
+            std::string token = readToken();
+            char * end;
+            long long value = strtoll(token.c_str(), &end, 10);
+            if (*end == 0 && (isdigit(token[0]) || (token.size() > 1 && token[0] == '-')))
+                return Value::Integer(value);
+            return Symbol::ForName(token);
+        }
+
+    private:
+
+        Value readList() {
+            List result;
+            while (true) {
+                skipWhitespace();
+                if (pos_ == source_.size())
+                    throw std::runtime_error("Unterminated list");
+                if (source_[pos_] == ')') {
+                    ++pos_;
+                    return result;
+                }
+                if (source_[pos_] == '.' && pos_ + 1 < source_.size() && isDelimiter(source_[pos_ + 1]))
+                    break;
+                result.append(read());
+            }
+            // dotted pair, the last element becomes the cdr of the last cons
+            ++pos_;
+            Value first = result;
+            Value tail = read();
+            skipWhitespace();
+            if (first == Nil || pos_ == source_.size() || source_[pos_] != ')')
+                throw std::runtime_error(STR("Malformed dotted pair at offset " << pos_));
+            ++pos_;
+            Value last = first;
+            while (last.cdr() != Nil)
+                last = last.cdr();
+            last.setCdr(tail);
+            return first;
+        }
+
+        std::string readToken() {
+            size_t start = pos_;
+            while (pos_ < source_.size() && ! isDelimiter(source_[pos_]))
+                ++pos_;
+            return source_.substr(start, pos_ - start);
+        }
+
+        void skipWhitespace() {
+            while (pos_ < source_.size()) {
+                if (isspace(source_[pos_])) {
+                    ++pos_;
+                } else if (source_[pos_] == ';') {
+                    while (pos_ < source_.size() && source_[pos_] != '\n')
+                        ++pos_;
+                } else {
+                    break;
+                }
+            }
+        }
+
+        static bool isDelimiter(char c) {
+            return isspace(c) || c == '(' || c == ')' || c == ';';
+        }
+
+        std::string source_;
+        size_t pos_;
+
+    }; // secd::Reader
+
+} // namespace secd